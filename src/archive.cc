@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#include "src/archive.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace darc2json {
+
+namespace {
+
+constexpr std::size_t kBatchSize      = 1 << 20;
+constexpr std::size_t kWriteBlockSize = 1 << 20;
+// The writer waits for the compressor once this many batches are queued
+constexpr std::size_t kMaxQueuedBatches = 8;
+// A batch that doesn't fill up is compressed after this long anyway
+constexpr std::chrono::seconds kMaxBatchAge(1);
+// Default window size, with a gzip header and trailer
+constexpr int kGzipWindowBits = 15 + 16;
+constexpr int kGzipMemLevel   = 8;
+constexpr int kGzipOsUnix     = 3;
+
+void PutLittleEndian(Bytef* out, std::uint64_t value) {
+  for (int i = 0; i < 8; i++) out[i] = static_cast<Bytef>(value >> (8 * i));
+}
+
+bool WriteAll(int fd, const Bytef* data, std::size_t size) {
+  while (size > 0) {
+    const ssize_t result = ::write(fd, data, size);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += result;
+    size -= result;
+  }
+  return true;
+}
+
+}  // namespace
+
+ArchiveSink::ArchiveSink(std::string prefix, std::uint64_t rotate_size,
+                         std::chrono::seconds rotate_interval)
+    : prefix_(std::move(prefix)),
+      rotate_size_(rotate_size),
+      rotate_interval_(rotate_interval),
+      out_buffer_(kWriteBlockSize) {
+  if (::deflateInit2(&stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, kGzipWindowBits, kGzipMemLevel,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    throw std::runtime_error("error: can't initialize zlib");
+
+  if (!open_file()) {
+    const std::string error = std::strerror(errno);
+    ::deflateEnd(&stream_);
+    throw std::runtime_error("error: can't create " + filename_ + ": " + error);
+  }
+
+  compressor_ = std::thread(&ArchiveSink::run_compressor, this);
+}
+
+ArchiveSink::~ArchiveSink() {
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    if (!batch_.data.empty())
+      queue_.push_back(std::move(batch_));
+    is_closing_ = true;
+  }
+  queue_changed_.notify_all();
+  compressor_.join();
+
+  close_file();
+  ::deflateEnd(&stream_);
+}
+
+void ArchiveSink::write_record(std::string_view record) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (batch_.data.empty())
+    batch_.started = std::chrono::steady_clock::now();
+  batch_.data.append(record);
+  batch_.num_records++;
+  if (batch_.data.size() < kBatchSize)
+    return;
+
+  Batch full_batch = std::move(batch_);
+  batch_           = Batch{};
+  queue_changed_.wait(lock, [this] { return queue_.size() < kMaxQueuedBatches; });
+  queue_.push_back(std::move(full_batch));
+  lock.unlock();
+  queue_changed_.notify_all();
+}
+
+// Compressor thread: take batches one at a time, and pick up a partial batch
+// once it has waited long enough
+void ArchiveSink::run_compressor() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (true) {
+    queue_changed_.wait_for(lock, kMaxBatchAge,
+                            [this] { return is_closing_ || !queue_.empty(); });
+
+    if (queue_.empty() && !batch_.data.empty() &&
+        std::chrono::steady_clock::now() - batch_.started >= kMaxBatchAge) {
+      queue_.push_back(std::move(batch_));
+      batch_ = Batch{};
+    }
+
+    if (queue_.empty()) {
+      if (is_closing_)
+        break;
+      continue;
+    }
+
+    const Batch batch = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    queue_changed_.notify_all();
+
+    compress(batch);
+    lock.lock();
+  }
+}
+
+void ArchiveSink::compress(const Batch& batch) {
+  const bool is_rotation_due =
+      (rotate_size_ > 0 && stream_.total_out >= rotate_size_) ||
+      (rotate_interval_.count() > 0 &&
+       std::chrono::steady_clock::now() - file_started_ >= rotate_interval_);
+
+  if (is_rotation_due) {
+    close_file();
+    if (!open_file())
+      std::cerr << "archive: can't create " << filename_ << ": " << std::strerror(errno)
+                << "; dropping records until the next rotation" << '\n';
+  }
+
+  if (fd_ >= 0) {
+    stream_.next_in  = reinterpret_cast<Bytef*>(const_cast<char*>(batch.data.data()));
+    stream_.avail_in = static_cast<uInt>(batch.data.size());
+    deflate_input(Z_NO_FLUSH);
+  }
+
+  num_records_ += batch.num_records;
+  num_bytes_ += batch.data.size();
+}
+
+bool ArchiveSink::open_file() {
+  const auto now = std::chrono::system_clock::now();
+  const auto unix_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch());
+  const std::time_t unix_time = std::chrono::system_clock::to_time_t(now);
+  file_started_               = std::chrono::steady_clock::now();
+
+  std::tm utc{};
+  ::gmtime_r(&unix_time, &utc);
+  char timestamp[32];
+  std::strftime(timestamp, sizeof(timestamp), "%Y%m%dT%H%M%SZ", &utc);
+  char number[16];
+  std::snprintf(number, sizeof(number), "%04d", file_number_++);
+  filename_ = prefix_ + "-" + timestamp + "-" + number + ".gz";
+
+  // Never overwrite an earlier archive
+  fd_ = ::open(filename_.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd_ < 0)
+    return false;
+
+  gzip_extra_[0] = 'D';
+  gzip_extra_[1] = 'J';
+  gzip_extra_[2] = 24;
+  gzip_extra_[3] = 0;
+  PutLittleEndian(&gzip_extra_[4], num_records_);
+  PutLittleEndian(&gzip_extra_[12], num_bytes_);
+  PutLittleEndian(&gzip_extra_[20], static_cast<std::uint64_t>(unix_ms.count()));
+
+  gzip_header_           = gz_header{};
+  gzip_header_.time      = static_cast<uLong>(unix_time);
+  gzip_header_.os        = kGzipOsUnix;
+  gzip_header_.extra     = gzip_extra_.data();
+  gzip_header_.extra_len = static_cast<uInt>(gzip_extra_.size());
+
+  ::deflateReset(&stream_);
+  ::deflateSetHeader(&stream_, &gzip_header_);
+  stream_.next_out  = out_buffer_.data();
+  stream_.avail_out = static_cast<uInt>(out_buffer_.size());
+  return true;
+}
+
+void ArchiveSink::close_file() {
+  if (fd_ < 0)
+    return;
+
+  stream_.avail_in = 0;
+  deflate_input(Z_FINISH);
+  write_out();
+  ::close(fd_);
+  fd_ = -1;
+}
+
+// Compress all of the pending input, writing out the output buffer whenever
+// it fills up
+void ArchiveSink::deflate_input(int flush) {
+  while (true) {
+    const int result = ::deflate(&stream_, flush);
+    if (stream_.avail_out == 0) {
+      write_out();
+      continue;
+    }
+    if (result == Z_STREAM_END || result == Z_STREAM_ERROR ||
+        (flush == Z_NO_FLUSH && stream_.avail_in == 0))
+      return;
+  }
+}
+
+void ArchiveSink::write_out() {
+  const std::size_t size = out_buffer_.size() - stream_.avail_out;
+  if (size > 0 && !WriteAll(fd_, out_buffer_.data(), size))
+    std::cerr << "archive: can't write " << filename_ << ": " << std::strerror(errno) << '\n';
+
+  stream_.next_out  = out_buffer_.data();
+  stream_.avail_out = static_cast<uInt>(out_buffer_.size());
+}
+
+}  // namespace darc2json
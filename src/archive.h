@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <zlib.h>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "src/output.h"
+
+namespace darc2json {
+
+// Writes records into a series of gzip files, compressed on a background
+// thread. Records are collected into batches of about 1 MiB, and the
+// compressed data is written out in blocks of the same size, so a file only
+// grows in large steps; it is complete once the next one has been started.
+//
+// A new file is started when the current one reaches `rotate_size` compressed
+// bytes or gets `rotate_interval` old; 0 disables either. Files are named
+// PREFIX-YYYYmmddTHHMMSSZ-NNNN.gz after the UTC time they were started.
+//
+// The gzip header of each file has an extra field with subfield ID "DJ" that
+// tells where the file begins in the whole output, so the right file can be
+// found without decompressing the others. Its 24 bytes are little-endian:
+//   uint64  number of records written before this file
+//   uint64  number of uncompressed bytes written before this file
+//   int64   Unix time in milliseconds when the file was started
+class ArchiveSink : public RecordSink {
+ public:
+  ArchiveSink(std::string prefix, std::uint64_t rotate_size, std::chrono::seconds rotate_interval);
+  ~ArchiveSink() override;
+  ArchiveSink(const ArchiveSink&)            = delete;
+  ArchiveSink& operator=(const ArchiveSink&) = delete;
+  void write_record(std::string_view record) override;
+
+ private:
+  struct Batch {
+    std::string data;
+    std::uint64_t num_records;
+    std::chrono::steady_clock::time_point started;
+  };
+
+  void run_compressor();
+  void compress(const Batch& batch);
+  bool open_file();
+  void close_file();
+  void deflate_input(int flush);
+  void write_out();
+
+  std::string prefix_;
+  std::uint64_t rotate_size_;
+  std::chrono::seconds rotate_interval_;
+
+  std::mutex mutex_;
+  std::condition_variable queue_changed_;
+  Batch batch_{};
+  std::deque<Batch> queue_;
+  bool is_closing_{};
+  std::thread compressor_;
+
+  // Only used by the compressor thread, after the constructor
+  z_stream stream_{};
+  gz_header gzip_header_{};
+  std::array<Bytef, 28> gzip_extra_{};
+  std::vector<Bytef> out_buffer_;
+  int fd_{-1};
+  std::string filename_;
+  int file_number_{};
+  std::chrono::steady_clock::time_point file_started_;
+  std::uint64_t num_records_{};
+  std::uint64_t num_bytes_{};
+};
+
+}  // namespace darc2json
+#endif  // ARCHIVE_H_
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#include "src/capture.h"
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace darc2json {
+
+namespace {
+
+constexpr std::array<char, 8> kCaptureMagic = {'d', 'a', 'r', 'c', 's', 'o', 'f', 't'};
+constexpr std::uint32_t kCaptureVersion     = 1;
+constexpr std::size_t kFileHeaderSize       = 16;
+constexpr std::size_t kChunkHeaderSize      = 32;
+constexpr std::size_t kIOBufferSize         = 1 << 20;
+// Far more than the demodulator produces per chunk; anything larger is corrupt
+constexpr std::size_t kMaxChunkBits         = 1 << 24;
+constexpr std::size_t kMaxDeltaBytes        = kMaxChunkBits * 10;
+
+void PutLE(std::uint8_t* out, std::uint64_t value, int num_bytes) {
+  for (int n_byte = 0; n_byte < num_bytes; n_byte++) out[n_byte] = (value >> (8 * n_byte)) & 0xFF;
+}
+
+std::uint64_t GetLE(const std::uint8_t* in, int num_bytes) {
+  std::uint64_t value = 0;
+  for (int n_byte = 0; n_byte < num_bytes; n_byte++)
+    value |= static_cast<std::uint64_t>(in[n_byte]) << (8 * n_byte);
+  return value;
+}
+
+std::uint32_t FloatBits(float value) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+float BitsToFloat(std::uint32_t bits) {
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+std::runtime_error WriteError(const std::string& filename) {
+  return std::runtime_error("error: can't write capture file '" + filename + "': " +
+                            std::strerror(errno));
+}
+
+// Unsigned LEB128: 7 bits per byte, least significant first, with the high
+// bit set on all but the last byte
+void AppendVarint(std::vector<std::uint8_t>& out, std::uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<std::uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<std::uint8_t>(value));
+}
+
+}  // namespace
+
+CaptureWriter::CaptureWriter(const std::string& filename)
+    : filename_(filename), file_(std::fopen(filename.c_str(), "wb")) {
+  if (file_ == nullptr)
+    throw std::runtime_error("error: can't open capture file '" + filename + "': " +
+                             std::strerror(errno));
+  std::setvbuf(file_, nullptr, _IOFBF, kIOBufferSize);
+
+  std::array<std::uint8_t, kFileHeaderSize> header{};
+  std::memcpy(header.data(), kCaptureMagic.data(), kCaptureMagic.size());
+  PutLE(&header[8], kCaptureVersion, 4);
+  PutLE(&header[12], static_cast<std::uint32_t>(kTargetSampleRate_Hz), 4);
+  write_bytes(header.data(), header.size());
+}
+
+CaptureWriter::~CaptureWriter() {
+  if (file_ != nullptr && std::fclose(file_) != 0)
+    std::cerr << WriteError(filename_).what() << '\n';
+}
+
+// Flush what's left in the buffer
+void CaptureWriter::close() {
+  std::FILE* file = file_;
+  file_           = nullptr;
+  if (file != nullptr && std::fclose(file) != 0)
+    throw WriteError(filename_);
+}
+
+void CaptureWriter::write_bytes(const void* data, std::size_t size) {
+  if (std::fwrite(data, 1, size, file_) != size)
+    throw WriteError(filename_);
+}
+
+void CaptureWriter::write(const SoftBits& bits, const std::vector<std::uint64_t>& sample_positions,
+                          const CaptureChunkInfo& info) {
+  if (bits.empty())
+    return;
+
+  deltas_.clear();
+  for (std::size_t n_bit = 1; n_bit < bits.size(); n_bit++)
+    AppendVarint(deltas_, sample_positions[n_bit] - sample_positions[n_bit - 1]);
+
+  std::array<std::uint8_t, kChunkHeaderSize> header{};
+  PutLE(&header[0], bits.size(), 4);
+  PutLE(&header[4], info.sample_num, 8);
+  PutLE(&header[12], FloatBits(info.agc_gain), 4);
+  PutLE(&header[16], FloatBits(info.mean_magnitude), 4);
+  PutLE(&header[20], sample_positions[0], 8);
+  PutLE(&header[28], deltas_.size(), 4);
+  write_bytes(header.data(), header.size());
+  write_bytes(bits.data(), bits.size() * sizeof(bits[0]));
+  write_bytes(deltas_.data(), deltas_.size());
+}
+
+CaptureReader::CaptureReader() : is_eof_(false) {
+  std::setvbuf(stdin, nullptr, _IOFBF, kIOBufferSize);
+
+  std::array<std::uint8_t, kFileHeaderSize> header{};
+  if (std::fread(header.data(), 1, header.size(), stdin) != header.size() ||
+      std::memcmp(header.data(), kCaptureMagic.data(), kCaptureMagic.size()) != 0)
+    throw std::runtime_error("error: input is not a soft bit capture");
+  if (GetLE(&header[8], 4) != kCaptureVersion)
+    throw std::runtime_error("error: unsupported soft bit capture version");
+}
+
+// Read one chunk of bits. A truncated last chunk is dropped.
+const SoftBits& CaptureReader::ReadBits() {
+  bits_.clear();
+  bit_sample_positions_.clear();
+
+  std::array<std::uint8_t, kChunkHeaderSize> header{};
+  if (std::fread(header.data(), 1, header.size(), stdin) != header.size()) {
+    is_eof_ = true;
+    return bits_;
+  }
+
+  chunk_info_.sample_num     = GetLE(&header[4], 8);
+  chunk_info_.agc_gain       = BitsToFloat(GetLE(&header[12], 4));
+  chunk_info_.mean_magnitude = BitsToFloat(GetLE(&header[16], 4));
+
+  const std::size_t num_bits = GetLE(&header[0], 4);
+  if (num_bits > kMaxChunkBits)
+    throw std::runtime_error("error: corrupt soft bit capture");
+
+  bits_.resize(num_bits);
+  if (std::fread(bits_.data(), sizeof(bits_[0]), bits_.size(), stdin) != bits_.size() ||
+      !read_sample_positions(GetLE(&header[20], 8), GetLE(&header[28], 4))) {
+    bits_.clear();
+    bit_sample_positions_.clear();
+    is_eof_ = true;
+  }
+
+  return bits_;
+}
+
+// Returns false at the end of a truncated file
+bool CaptureReader::read_sample_positions(std::uint64_t first_position,
+                                          std::size_t num_delta_bytes) {
+  if (num_delta_bytes > kMaxDeltaBytes)
+    throw std::runtime_error("error: corrupt soft bit capture");
+
+  deltas_.resize(num_delta_bytes);
+  if (std::fread(deltas_.data(), 1, deltas_.size(), stdin) != deltas_.size())
+    return false;
+
+  bit_sample_positions_.resize(bits_.size());
+  if (bits_.empty())
+    return true;
+
+  bit_sample_positions_[0] = first_position;
+  std::size_t n_byte       = 0;
+  for (std::size_t n_bit = 1; n_bit < bits_.size(); n_bit++) {
+    std::uint64_t delta = 0;
+    for (int shift = 0;; shift += 7) {
+      if (n_byte >= deltas_.size() || shift > 63)
+        throw std::runtime_error("error: corrupt soft bit capture");
+      const std::uint8_t byte = deltas_[n_byte++];
+      delta |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0)
+        break;
+    }
+    bit_sample_positions_[n_bit] = bit_sample_positions_[n_bit - 1] + delta;
+  }
+  return true;
+}
+
+const std::vector<std::uint64_t>& CaptureReader::bit_sample_positions() const {
+  return bit_sample_positions_;
+}
+
+const CaptureChunkInfo& CaptureReader::chunk_info() const {
+  return chunk_info_;
+}
+
+bool CaptureReader::eof() const {
+  return is_eof_;
+}
+
+}  // namespace darc2json
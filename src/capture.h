@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "src/common.h"
+#include "src/util.h"
+
+namespace darc2json {
+
+// Soft bit capture files hold the output of Layer 1, so that the protocol
+// layers can be run again without demodulating the signal.
+//
+// All integers and floats are little-endian. The file starts with the 8-byte
+// magic "darcsoft", a uint32 format version and the uint32 sample rate the
+// demodulator ran at. It is followed by chunks of bits, each with the header
+//
+//   uint32  number of soft bits in the chunk
+//   uint64  number of samples demodulated by the end of the chunk
+//   float32 AGC gain at the end of the chunk
+//   float32 mean soft bit magnitude before quantization
+//   uint64  sample position of the first bit
+//   uint32  size of the sample position deltas in bytes
+//
+// and then one signed byte per soft bit, followed by the sample position of
+// every other bit as its distance from the bit before, in unsigned LEB128.
+
+// Demodulator state at the end of a chunk of bits
+struct CaptureChunkInfo {
+  std::uint64_t sample_num{};
+  float agc_gain{};
+  float mean_magnitude{};
+};
+
+// Write errors throw std::runtime_error. Call close() to find out whether the
+// end of the file made it to disk; the destructor can only print a warning.
+class CaptureWriter {
+ public:
+  explicit CaptureWriter(const std::string& filename);
+  ~CaptureWriter();
+  CaptureWriter(const CaptureWriter&)            = delete;
+  CaptureWriter& operator=(const CaptureWriter&) = delete;
+  // `sample_positions` has the sample number of each bit
+  void write(const SoftBits& bits, const std::vector<std::uint64_t>& sample_positions,
+             const CaptureChunkInfo& info);
+  void close();
+
+ private:
+  void write_bytes(const void* data, std::size_t size);
+
+  std::string filename_;
+  std::FILE* file_;
+  std::vector<std::uint8_t> deltas_;
+};
+
+// Reads a capture file from stdin
+class CaptureReader {
+ public:
+  CaptureReader();
+  ~CaptureReader() = default;
+  const SoftBits& ReadBits();
+  // Sample number at which each bit of the last ReadBits() was received
+  const std::vector<std::uint64_t>& bit_sample_positions() const;
+  const CaptureChunkInfo& chunk_info() const;
+  bool eof() const;
+
+ private:
+  bool read_sample_positions(std::uint64_t first_position, std::size_t num_delta_bytes);
+
+  SoftBits bits_;
+  std::vector<std::uint64_t> bit_sample_positions_;
+  std::vector<std::uint8_t> deltas_;
+  CaptureChunkInfo chunk_info_;
+  bool is_eof_;
+};
+
+}  // namespace darc2json
+#endif  // CAPTURE_H_
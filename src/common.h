@@ -17,16 +17,35 @@
 #ifndef COMMON_H_
 #define COMMON_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace darc2json {
 
 constexpr float kTargetSampleRate_Hz = 228'000.0f;
-constexpr int kNumBlerAverageGroups  = 12;
+constexpr double kSamplesPerBit      = kTargetSampleRate_Hz / 16'000.0;
+constexpr int kNumBlerAverageBlocks  = 272;
 
-enum class InputType { MpxStdin, MpxSndfile, AsciiBits, Hex };
+enum class InputType {
+  MpxStdin,
+  MpxSndfile,
+  MpxRawFile,
+  AsciiBits,
+  PackedBits,
+  SoftBitCapture,
+  Hex
+};
+
+enum class OutputType { Hex, Json, Cbor };
+
+// When buffered output is written out: after every line, after an interval
+// has passed, or after enough bytes have accumulated
+enum class FlushPolicy { Line, Interval, Size };
 
-enum class OutputType { Hex, Json };
+// What to do with a record when the output queue is full
+enum class QueueFullPolicy { Block, DropOldest, DropNewest };
 
 struct Options {
   bool feed_thru{};
@@ -34,10 +53,42 @@ struct Options {
   bool just_exit{};
   bool timestamp{};
   bool bler{};
+  bool carousel{};
+  bool changes_only{};
+  bool ignore_tdt_clock{};
+  int chase_bits{6};
+  int heartbeat_s{};
+  bool sequence{};
+  bool latency{};
+  // Only decode these; empty lists let everything through
+  std::vector<int> silch_filter;
+  std::vector<int> data_type_filter;
+  std::vector<int> transport_id_filter;
+  // Tag for records when decoding several streams, or -1
+  int stream_id{-1};
+  int num_threads{};
+  bool parallel{};
+  bool pipeline{};
   float samplerate{kTargetSampleRate_Hz};
   InputType input_type{InputType::MpxStdin};
   OutputType output_type{OutputType::Json};
+  FlushPolicy flush_policy{FlushPolicy::Line};
+  int flush_interval_ms{};
+  std::size_t flush_size{};
+  // Number of records queued for the output thread, or 0 to write directly
+  std::size_t output_queue_size{};
+  QueueFullPolicy queue_full_policy{QueueFullPolicy::DropOldest};
   std::string sndfilename;
+  // Part of the audio file to read, in samples; -1 reads to the end
+  std::int64_t input_start_sample{};
+  std::int64_t input_num_samples{-1};
+  std::string capture_filename;
+  std::vector<std::string> stream_filenames;
+  std::vector<std::string> sink_specs;
+  // Start a new archive file after this many compressed bytes or seconds; 0
+  // never does
+  std::uint64_t rotate_size{};
+  int rotate_interval_s{};
   std::string time_format;
 };
 
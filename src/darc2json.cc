@@ -16,43 +16,192 @@
  *
  */
 #include <getopt.h>
+#include <algorithm>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "config.h"
+#include "src/capture.h"
 #include "src/common.h"
+#include "src/input.h"
 #include "src/layer1.h"
 #include "src/layer2.h"
 #include "src/layer3_4.h"
+#include "src/output.h"
+#include "src/pipeline.h"
+#include "src/streams.h"
 
 namespace darc2json {
 
+// Values for options that only have a long form
+enum LongOption {
+  kOptCapture = 256,
+  kOptCarousel,
+  kOptDataType,
+  kOptFlush,
+  kOptHeartbeat,
+  kOptIgnoreTdtClock,
+  kOptLatency,
+  kOptOutputQueue,
+  kOptParallel,
+  kOptPipeline,
+  kOptQueueFull,
+  kOptRotateInterval,
+  kOptRotateSize,
+  kOptSequence,
+  kOptSilch,
+  kOptSink,
+  kOptStream,
+  kOptThreads,
+  kOptTransportId
+};
+
 void PrintUsage() {
   std::cout << "radio_command | darc2json [OPTIONS]\n"
                "\n"
                "By default, a 228 kHz single-channel 16-bit MPX signal is expected via\n"
                "stdin.\n"
                "\n"
+               "--capture FILENAME     Save the demodulated soft bits to a file,\n"
+               "                       to be decoded again later with --input soft.\n"
+               "\n"
+               "--carousel             Merge long message frames from repeated\n"
+               "                       transmissions until they are complete, and\n"
+               "                       print each one again only if it changes.\n"
+               "\n"
+               "-c, --chase-bits NUM   Try flipping combinations of up to NUM (0-7)\n"
+               "                       least reliable bits to correct blocks with\n"
+               "                       multiple errors. Each added bit doubles the\n"
+               "                       worst-case work per block. Default is 6.\n"
+               "\n"
+               "--data-type LIST       Only decode messages of these types, given\n"
+               "                       as numbers or service message type names\n"
+               "                       like TDT, separated by commas. Long\n"
+               "                       messages have their L4 type, e.g. 12 for\n"
+               "                       group data. Other messages are dropped.\n"
+               "\n"
                "-e, --feed-through     Echo the input signal to stdout and print\n"
                "                       decoded groups to stderr.\n"
                "\n"
                "-E, --bler             Display the average block error rate, or the\n"
                "                       percentage of blocks that had errors before\n"
-               "                       error correction. Averaged over the last 12\n"
-               "                       groups. For hex input, this is the percentage\n"
-               "                       of missing blocks.\n"
+               "                       error correction or were lost. Averaged over\n"
+               "                       the last 272 blocks. The number of bit slips\n"
+               "                       recovered is printed to stderr at exit.\n"
                "\n"
                "-f, --file FILENAME    Use an audio file as MPX input. All formats\n"
                "                       readable by libsndfile should work.\n"
                "\n"
+               "--flush POLICY         When to flush output: \"line\" after every\n"
+               "                       line (default), \"NUMms\" every NUM\n"
+               "                       milliseconds, or \"NUMk\" whenever NUM kB\n"
+               "                       have been buffered.\n"
+               "\n"
+               "--heartbeat SECONDS    With --changes-only, repeat unchanged service\n"
+               "                       messages at most this often.\n"
+               "\n"
+               "--ignore-tdt-clock     With --changes-only, don't count a TDT as\n"
+               "                       changed if only its date and time changed.\n"
+               "\n"
+               "-i, --input FORMAT     Input format: \"mpx\" for the MPX signal\n"
+               "                       (default), \"ascii\" for demodulated bits as\n"
+               "                       '0' and '1' characters, \"packed\" for bits\n"
+               "                       packed 8 per byte, MSB first, \"soft\" to\n"
+               "                       replay soft bits saved with --capture, or\n"
+               "                       \"hex\" to replay L2 blocks written by\n"
+               "                       --output hex.\n"
+               "\n"
+               "--latency              Add \"latency_ms\" to each record: the time\n"
+               "                       from reception, as with --timestamp, to\n"
+               "                       output. Only meaningful for live input.\n"
+               "\n"
+               "-o, --output FORMAT    Output format: \"json\" for one JSON object\n"
+               "                       per line (default), \"cbor\" for CBOR\n"
+               "                       records, each preceded by its length as a\n"
+               "                       32-bit big-endian integer, or \"hex\" for\n"
+               "                       a dump of the raw L2 blocks, one per line.\n"
+               "\n"
+               "--output-queue NUM     Write the output on a separate thread,\n"
+               "                       through a queue of up to NUM records, so\n"
+               "                       that a slow reader never stalls decoding.\n"
+               "                       Prints queue statistics to stderr at the\n"
+               "                       end.\n"
+               "\n"
+               "--parallel             With --file, decode overlapping time\n"
+               "                       segments of the file on all cores (or\n"
+               "                       --threads) and merge the results in order.\n"
+               "\n"
+               "--pipeline             Run reading, demodulation, decoding and\n"
+               "                       output on separate threads joined by\n"
+               "                       queues, so that a slow reader of the output\n"
+               "                       doesn't stall the demodulator. Prints queue\n"
+               "                       statistics to stderr at the end.\n"
+               "\n"
+               "--queue-full POLICY    With --output-queue, what to do when the\n"
+               "                       queue is full: \"drop-oldest\" (default),\n"
+               "                       \"drop-newest\" or \"block\".\n"
+               "\n"
+               "--rotate-interval SEC  With a gzip sink, start a new file every\n"
+               "                       SEC seconds.\n"
+               "\n"
+               "--rotate-size MB       With a gzip sink, start a new file when the\n"
+               "                       current one reaches MB megabytes.\n"
+               "\n"
                "-r, --samplerate RATE  Set stdin sample frequency in Hz. Will resample\n"
                "                       (slow) if this differs from 171000 Hz.\n"
                "\n"
-               "-t, --timestamp FORMAT Add time of decoding to JSON groups; see\n"
-               "                       man strftime for formatting options (or\n"
-               "                       try \"%c\").\n"
+               "--sequence             Add \"seq\", a number counting the records of\n"
+               "                       each stream from 0, and \"sample\", the\n"
+               "                       sample (at 228 kHz) at which the last block\n"
+               "                       of the record was received.\n"
+               "\n"
+               "--silch LIST           Only decode these channels: \"sech\"\n"
+               "                       (service), \"lmch\" (long messages),\n"
+               "                       \"bach\" (block application) or silch\n"
+               "                       numbers, separated by commas. Blocks on\n"
+               "                       other channels are skipped unparsed.\n"
+               "\n"
+               "--sink SINK            Publish the output to SINK instead of\n"
+               "                       stdout. Can be given several times:\n"
+               "                       \"unix:PATH\" serves a Unix domain socket,\n"
+               "                       \"tcp:[ADDRESS:]PORT\" a TCP socket,\n"
+               "                       \"udp:[ADDRESS:]PORT\" sends datagrams,\n"
+               "                       \"shm:NAME\" writes to a shared memory ring\n"
+               "                       buffer (see src/sinks.h), and\n"
+               "                       \"gzip:PREFIX\" writes compressed files named\n"
+               "                       PREFIX-TIME-NUMBER.gz (see src/archive.h).\n"
+               "                       The address defaults to 127.0.0.1.\n"
+               "                       \"stdout\" keeps writing to stdout as well.\n"
+               "\n"
+               "--stream FILENAME      Decode this MPX input in addition to any\n"
+               "                       other --stream, on a shared pool of\n"
+               "                       threads. Records are tagged with the\n"
+               "                       number of their stream, counting from 0.\n"
+               "                       FIFOs are read as raw 16-bit MPX at the\n"
+               "                       --samplerate; \"-\" is stdin.\n"
+               "\n"
+               "--threads NUM          Number of threads for --stream or\n"
+               "                       --parallel. Default is one per stream, or\n"
+               "                       per core, up to the number of cores.\n"
+               "\n"
+               "-t, --timestamp FORMAT Add the time of reception to JSON groups:\n"
+               "                       the time decoding started plus the sample\n"
+               "                       position. See man strftime for formatting\n"
+               "                       options (or try \"%c\").\n"
+               "\n"
+               "--transport-id LIST    Only decode L5 group data with these\n"
+               "                       transport ids, separated by commas. Other\n"
+               "                       messages are dropped.\n"
+               "\n"
+               "-u, --changes-only     Only print service messages whose content\n"
+               "                       changed since the last one of the same type\n"
+               "                       from the same network.\n"
                "\n"
                "-v, --version          Print version string.\n";
 }
@@ -61,31 +210,227 @@ void PrintVersion() {
   std::cout << "darc2json " << VERSION << " by OH2EIQ" << '\n';
 }
 
+// Comma-separated numbers from 0 to max_value, in decimal or in hex with 0x,
+// or names that stand for numbers
+bool ParseFilterList(const std::string& list, int max_value,
+                     const std::map<std::string, int>& names, std::vector<int>& values) {
+  std::size_t start = 0;
+  while (start <= list.size()) {
+    const std::size_t end  = std::min(list.find(',', start), list.size());
+    const std::string item = list.substr(start, end - start);
+
+    char* suffix      = nullptr;
+    const long number = std::strtol(item.c_str(), &suffix, item.rfind("0x", 0) == 0 ? 16 : 10);
+    if (names.count(item) > 0)
+      values.push_back(names.at(item));
+    else if (!item.empty() && *suffix == '\0' && number >= 0 && number <= max_value)
+      values.push_back(static_cast<int>(number));
+    else
+      return false;
+
+    start = end + 1;
+  }
+
+  return true;
+}
+
+// "line", "NUMms" or "NUMk"
+bool ParseFlushPolicy(const std::string& policy, Options& options) {
+  char* suffix      = nullptr;
+  const long amount = std::strtol(policy.c_str(), &suffix, 10);
+
+  if (policy == "line") {
+    options.flush_policy = FlushPolicy::Line;
+  } else if (suffix != policy.c_str() && amount > 0 && std::string(suffix) == "ms") {
+    options.flush_policy      = FlushPolicy::Interval;
+    options.flush_interval_ms = amount;
+  } else if (suffix != policy.c_str() && amount > 0 && std::string(suffix) == "k") {
+    options.flush_policy = FlushPolicy::Size;
+    options.flush_size   = amount * 1024;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
 Options GetOptions(int argc, char** argv) {
   darc2json::Options options;
 
   static struct option long_options[] = {
-      {"feed-through", no_argument,       0, 'e'},
-      {"bler",         no_argument,       0, 'E'},
-      {"file",         required_argument, 0, 'f'},
-      {"samplerate",   required_argument, 0, 'r'},
-      {"timestamp",    required_argument, 0, 't'},
-      {"version",      no_argument,       0, 'v'},
-      {"help",         no_argument,       0, '?'},
-      {0,              0,                 0, 0  }
+      {"capture",          required_argument, 0, kOptCapture       },
+      {"carousel",         no_argument,       0, kOptCarousel      },
+      {"chase-bits",       required_argument, 0, 'c'               },
+      {"data-type",        required_argument, 0, kOptDataType      },
+      {"feed-through",     no_argument,       0, 'e'               },
+      {"bler",             no_argument,       0, 'E'               },
+      {"file",             required_argument, 0, 'f'               },
+      {"flush",            required_argument, 0, kOptFlush         },
+      {"heartbeat",        required_argument, 0, kOptHeartbeat     },
+      {"ignore-tdt-clock", no_argument,       0, kOptIgnoreTdtClock},
+      {"input",            required_argument, 0, 'i'               },
+      {"latency",          no_argument,       0, kOptLatency       },
+      {"output",           required_argument, 0, 'o'               },
+      {"output-queue",     required_argument, 0, kOptOutputQueue   },
+      {"parallel",         no_argument,       0, kOptParallel      },
+      {"pipeline",         no_argument,       0, kOptPipeline      },
+      {"queue-full",       required_argument, 0, kOptQueueFull     },
+      {"rotate-interval",  required_argument, 0, kOptRotateInterval},
+      {"rotate-size",      required_argument, 0, kOptRotateSize    },
+      {"samplerate",       required_argument, 0, 'r'               },
+      {"sequence",         no_argument,       0, kOptSequence      },
+      {"silch",            required_argument, 0, kOptSilch         },
+      {"sink",             required_argument, 0, kOptSink          },
+      {"stream",           required_argument, 0, kOptStream        },
+      {"threads",          required_argument, 0, kOptThreads       },
+      {"timestamp",        required_argument, 0, 't'               },
+      {"transport-id",     required_argument, 0, kOptTransportId   },
+      {"changes-only",     no_argument,       0, 'u'               },
+      {"version",          no_argument,       0, 'v'               },
+      {"help",             no_argument,       0, '?'               },
+      {0,                  0,                 0, 0                 }
   };
 
   int option_index = 0;
   int option_char;
 
-  while ((option_char = ::getopt_long(argc, argv, "eEf:r:t:v", long_options, &option_index)) >= 0) {
+  while ((option_char = ::getopt_long(argc, argv, "c:eEf:i:o:r:t:uv", long_options, &option_index)) >= 0) {
     switch (option_char) {
+      case 'c':
+        options.chase_bits = std::atoi(optarg);
+        if (options.chase_bits < 0 || options.chase_bits > darc2json::kMaxChaseBits) {
+          std::cerr << "error: chase bits must be between 0 and " << darc2json::kMaxChaseBits
+                    << '\n';
+          options.just_exit = true;
+        }
+        break;
       case 'e': options.feed_thru = true; break;
       case 'E': options.bler = true; break;
       case 'f':
         options.sndfilename = std::string(optarg);
         options.input_type  = darc2json::InputType::MpxSndfile;
         break;
+      case kOptCapture: options.capture_filename = std::string(optarg); break;
+      case kOptCarousel: options.carousel = true; break;
+      case kOptDataType: {
+        std::map<std::string, int> type_names;
+        for (std::size_t n_type = 0; n_type < darc2json::kSechTypeNames.size(); n_type++)
+          type_names[darc2json::kSechTypeNames[n_type]] = static_cast<int>(n_type);
+        if (!ParseFilterList(optarg, 15, type_names, options.data_type_filter)) {
+          std::cerr << "error: invalid data type list '" << optarg << "'" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      }
+      case kOptFlush:
+        if (!ParseFlushPolicy(optarg, options)) {
+          std::cerr << "error: unknown flush policy '" << optarg << "'" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      case kOptHeartbeat:
+        options.changes_only = true;
+        options.heartbeat_s  = std::atoi(optarg);
+        if (options.heartbeat_s < 1) {
+          std::cerr << "error: heartbeat interval must be at least 1 second" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      case kOptIgnoreTdtClock:
+        options.changes_only     = true;
+        options.ignore_tdt_clock = true;
+        break;
+      case kOptLatency: options.latency = true; break;
+      case kOptOutputQueue:
+        options.output_queue_size = std::atoi(optarg);
+        if (std::atoi(optarg) < 1) {
+          std::cerr << "error: output queue must hold at least 1 record" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      case kOptParallel: options.parallel = true; break;
+      case kOptPipeline: options.pipeline = true; break;
+      case kOptQueueFull:
+        if (std::string(optarg) == "block") {
+          options.queue_full_policy = darc2json::QueueFullPolicy::Block;
+        } else if (std::string(optarg) == "drop-oldest") {
+          options.queue_full_policy = darc2json::QueueFullPolicy::DropOldest;
+        } else if (std::string(optarg) == "drop-newest") {
+          options.queue_full_policy = darc2json::QueueFullPolicy::DropNewest;
+        } else {
+          std::cerr << "error: unknown queue policy '" << optarg << "'" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      case kOptRotateInterval:
+        options.rotate_interval_s = std::atoi(optarg);
+        if (options.rotate_interval_s < 1) {
+          std::cerr << "error: rotation interval must be at least 1 second" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      case kOptRotateSize: {
+        const int megabytes = std::atoi(optarg);
+        if (megabytes < 1) {
+          std::cerr << "error: rotation size must be at least 1 MB" << '\n';
+          options.just_exit = true;
+        }
+        options.rotate_size = static_cast<std::uint64_t>(megabytes) * 1000000;
+        break;
+      }
+      case kOptSequence: options.sequence = true; break;
+      case kOptSilch: {
+        const std::map<std::string, int> channel_names = {
+            {"sech", 0x8}, {"smch", 0x9}, {"lmch", 0xA}, {"bach", 0xB}};
+        if (!ParseFilterList(optarg, 15, channel_names, options.silch_filter)) {
+          std::cerr << "error: invalid channel list '" << optarg << "'" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      }
+      case kOptSink: options.sink_specs.push_back(std::string(optarg)); break;
+      case kOptStream: options.stream_filenames.push_back(std::string(optarg)); break;
+      case kOptThreads:
+        options.num_threads = std::atoi(optarg);
+        if (options.num_threads < 1) {
+          std::cerr << "error: number of threads must be at least 1" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      case kOptTransportId:
+        if (!ParseFilterList(optarg, 0xFFFF, {}, options.transport_id_filter)) {
+          std::cerr << "error: invalid transport id list '" << optarg << "'" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      case 'i':
+        if (std::string(optarg) == "mpx") {
+          options.input_type = darc2json::InputType::MpxStdin;
+        } else if (std::string(optarg) == "ascii") {
+          options.input_type = darc2json::InputType::AsciiBits;
+        } else if (std::string(optarg) == "packed") {
+          options.input_type = darc2json::InputType::PackedBits;
+        } else if (std::string(optarg) == "soft") {
+          options.input_type = darc2json::InputType::SoftBitCapture;
+        } else if (std::string(optarg) == "hex") {
+          options.input_type = darc2json::InputType::Hex;
+        } else {
+          std::cerr << "error: unknown input format '" << optarg << "'" << '\n';
+          options.just_exit = true;
+        }
+        break;
+      case 'o':
+        if (std::string(optarg) == "json") {
+          options.output_type = darc2json::OutputType::Json;
+        } else if (std::string(optarg) == "cbor") {
+          options.output_type = darc2json::OutputType::Cbor;
+        } else if (std::string(optarg) == "hex") {
+          options.output_type = darc2json::OutputType::Hex;
+        } else {
+          std::cerr << "error: unknown output format '" << optarg << "'" << '\n';
+          options.just_exit = true;
+        }
+        break;
       case 'p': options.show_partial = true; break;
       case 'r':
         options.samplerate = std::atoi(optarg);
@@ -98,6 +443,7 @@ Options GetOptions(int argc, char** argv) {
         options.timestamp   = true;
         options.time_format = std::string(optarg);
         break;
+      case 'u': options.changes_only = true; break;
       case 'v':
         PrintVersion();
         options.just_exit = true;
@@ -117,6 +463,27 @@ Options GetOptions(int argc, char** argv) {
     options.just_exit = true;
   }
 
+  if ((!options.stream_filenames.empty() || options.parallel) &&
+      (options.output_type == OutputType::Hex || !options.capture_filename.empty())) {
+    std::cerr << "error: --stream and --parallel can't be used with hex output or --capture"
+              << '\n';
+    options.just_exit = true;
+  }
+
+  const bool is_mpx_input =
+      (options.input_type == InputType::MpxStdin || options.input_type == InputType::MpxSndfile);
+  if (options.pipeline && (!is_mpx_input || !options.capture_filename.empty() ||
+                           !options.stream_filenames.empty() || options.parallel)) {
+    std::cerr << "error: --pipeline only works with a single MPX input, without --capture"
+              << '\n';
+    options.just_exit = true;
+  }
+
+  if (options.parallel && options.input_type != InputType::MpxSndfile) {
+    std::cerr << "error: --parallel needs an audio file input" << '\n';
+    options.just_exit = true;
+  }
+
   return options;
 }
 
@@ -128,15 +495,83 @@ int main(int argc, char** argv) {
   if (options.just_exit)
     return EXIT_FAILURE;
 
-  darc2json::Layer2 layer2;
-  darc2json::Layer3 layer3(options);
+  // Files, sockets and inputs that can't be opened or read throw runtime errors
+  try {
+    darc2json::Output output(options);
+    darc2json::Layer2 layer2(options);
+    darc2json::Layer3 layer3(options, output);
+
+    // Hex output is a dump of the L2 blocks, without any parsing beyond L2
+    std::string hex_record;
+    const darc2json::L2BlockSink sink =
+        options.output_type == darc2json::OutputType::Hex
+            ? darc2json::L2BlockSink([&output, &hex_record](const darc2json::L2Block& l2block) {
+                hex_record.clear();
+                darc2json::AppendL2BlockHex(hex_record, l2block);
+                output.write_record(hex_record);
+              })
+            : darc2json::L2BlockSink([&layer3](const darc2json::L2Block& l2block) {
+                layer3.push_block(l2block);
+              });
+
+    if (!options.stream_filenames.empty()) {
+      darc2json::DecodeStreams(options, output);
+    } else if (options.parallel) {
+      darc2json::DecodeSegments(options, output);
+    } else if (options.pipeline) {
+      darc2json::RunPipeline(options, output);
+    } else if (options.input_type == darc2json::InputType::Hex) {
+      darc2json::HexBlockReader reader(options);
+      while (!reader.eof()) {
+        reader.ReadBlocks(sink);
+        output.poll();
+      }
+    } else if (options.input_type == darc2json::InputType::AsciiBits ||
+               options.input_type == darc2json::InputType::PackedBits) {
+      std::unique_ptr<darc2json::BitstreamReader> reader;
+      if (options.input_type == darc2json::InputType::AsciiBits)
+        reader = std::make_unique<darc2json::AsciiBitReader>(options);
+      else
+        reader = std::make_unique<darc2json::PackedBitReader>(options);
 
-  darc2json::Subcarrier subc(options);
-  while (!subc.eof()) {
-    const auto blocks = layer2.PushBit(subc.NextBit());
-    for (const darc2json::L2Block& l2block : blocks) {
-      layer3.push_block(l2block);
+      while (!reader->eof()) {
+        const darc2json::PackedBits& bits = reader->ReadBits();
+        layer2.PushPackedBits(bits.words.data(), bits.num_bits, sink);
+        output.poll();
+      }
+      if (options.bler)
+        darc2json::PrintSlipCount(layer2.num_slips());
+    } else if (options.input_type == darc2json::InputType::SoftBitCapture) {
+      darc2json::CaptureReader reader;
+      while (!reader.eof()) {
+        const darc2json::SoftBits& bits = reader.ReadBits();
+        layer2.PushBits(bits.data(), bits.size(), sink, reader.bit_sample_positions().data());
+        output.poll();
+      }
+      if (options.bler)
+        darc2json::PrintSlipCount(layer2.num_slips());
+    } else {
+      std::unique_ptr<darc2json::CaptureWriter> capture;
+      if (!options.capture_filename.empty())
+        capture = std::make_unique<darc2json::CaptureWriter>(options.capture_filename);
+
+      darc2json::Subcarrier subc(options);
+      while (!subc.eof()) {
+        const darc2json::SoftBits& bits = subc.ReadBits();
+        if (capture)
+          capture->write(bits, subc.bit_sample_positions(),
+                         {subc.sample_num(), subc.agc_gain(), subc.mean_magnitude()});
+        layer2.PushBits(bits.data(), bits.size(), sink, subc.bit_sample_positions().data());
+        output.poll();
+      }
+      if (capture)
+        capture->close();
+      if (options.bler)
+        darc2json::PrintSlipCount(layer2.num_slips());
     }
+  } catch (const std::runtime_error& e) {
+    std::cerr << e.what() << '\n';
+    return EXIT_FAILURE;
   }
 
   return EXIT_SUCCESS;
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#ifndef HEADER_VIEWS_H_
+#define HEADER_VIEWS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "src/util.h"
+
+namespace darc2json {
+
+// Typed views of the protocol headers in packed bytes. Field positions are
+// fixed at compile time, and the views neither copy nor own the bytes.
+
+// L3 header of any block, in the L2 information bytes
+class L3HeaderView {
+ public:
+  constexpr explicit L3HeaderView(ByteView info_bytes) : bytes_(info_bytes) {}
+  constexpr int silch() const {
+    return BitField<BitOrder::LsbFirst, 0, 4>::Read(bytes_);
+  }
+  constexpr bool is_last_fragment() const {
+    return BitField<BitOrder::LsbFirst, 5, 1>::Read(bytes_);
+  }
+
+  // Block application channel
+  constexpr int subchannel() const {
+    return BitField<BitOrder::LsbFirst, 5, 3>::Read(bytes_);
+  }
+
+  // Service channel
+  constexpr int data_update() const {
+    return BitField<BitOrder::LsbFirst, 6, 2>::Read(bytes_);
+  }
+  constexpr int country_id() const {
+    return BitField<BitOrder::LsbFirst, 8, 4>::Read(bytes_);
+  }
+  constexpr int data_type() const {
+    return BitField<BitOrder::LsbFirst, 12, 4>::Read(bytes_);
+  }
+  constexpr int network_id() const {
+    return BitField<BitOrder::LsbFirst, 16, 4>::Read(bytes_);
+  }
+  constexpr int block_num() const {
+    return BitField<BitOrder::LsbFirst, 20, 4>::Read(bytes_);
+  }
+
+  // Long message channel
+  constexpr int sequence_counter() const {
+    return BitField<BitOrder::LsbFirst, 6, 4>::Read(bytes_);
+  }
+
+ private:
+  ByteView bytes_;
+};
+
+// L4 header of a long message frame, read MSB first
+class L4HeaderView {
+ public:
+  constexpr explicit L4HeaderView(ByteView frame) : bytes_(frame) {}
+  constexpr bool has_crc() const {
+    return BitField<BitOrder::MsbFirst, 1, 1>::Read(bytes_);
+  }
+  constexpr int channel_id() const {
+    return BitField<BitOrder::MsbFirst, 2, 2>::Read(bytes_);
+  }
+  constexpr bool is_first() const {
+    return BitField<BitOrder::MsbFirst, 4, 1>::Read(bytes_);
+  }
+  constexpr bool is_last() const {
+    return BitField<BitOrder::MsbFirst, 5, 1>::Read(bytes_);
+  }
+  constexpr bool ext() const {
+    return BitField<BitOrder::MsbFirst, 6, 1>::Read(bytes_);
+  }
+  // The low nibble of the first byte; 12 for unfragmented L5 group data
+  constexpr int type() const {
+    return BitField<BitOrder::MsbFirst, 4, 4>::Read(bytes_);
+  }
+  constexpr bool caf() const {
+    return BitField<BitOrder::MsbFirst, 17, 1>::Read(bytes_);
+  }
+  // In bytes
+  constexpr std::size_t length() const {
+    return 4 + ext();
+  }
+  // Number of data bytes after the header; the rest of the frame is padding
+  constexpr std::size_t data_length() const {
+    return ext() ? BitField<BitOrder::MsbFirst, 26, 8>::Read(bytes_)
+                 : BitField<BitOrder::MsbFirst, 18, 8>::Read(bytes_);
+  }
+
+ private:
+  ByteView bytes_;
+};
+
+// L5 group data header, following the L4 header
+class L5HeaderView {
+ public:
+  constexpr explicit L5HeaderView(ByteView frame) : bytes_(frame) {}
+  constexpr int header_length() const {
+    return BitField<BitOrder::MsbFirst, 16, 4>::Read(bytes_);
+  }
+  constexpr int transport_id() const {
+    return BitField<BitOrder::MsbFirst, 31, 16>::Read(bytes_);
+  }
+
+ private:
+  ByteView bytes_;
+};
+
+// Start of a service message payload, common to all data types
+class ServiceHeaderView {
+ public:
+  constexpr explicit ServiceHeaderView(ByteView data_bytes) : bytes_(data_bytes) {}
+  constexpr int ecc() const {
+    return BitField<BitOrder::LsbFirst, 0, 8>::Read(bytes_);
+  }
+  constexpr int tse_id() const {
+    return BitField<BitOrder::LsbFirst, 8, 7>::Read(bytes_);
+  }
+
+ private:
+  ByteView bytes_;
+};
+
+// Time and date transmission (TDT) payload, read MSB first
+class TdtView {
+ public:
+  // The fields that change as the clock runs
+  using Hour               = BitField<BitOrder::MsbFirst, 25, 5>;
+  using Minute             = BitField<BitOrder::MsbFirst, 30, 6>;
+  using Seconds            = BitField<BitOrder::MsbFirst, 36, 6>;
+  using ModifiedJulianDate = BitField<BitOrder::MsbFirst, 57, 17>;
+
+  constexpr explicit TdtView(ByteView data_bytes) : bytes_(data_bytes) {}
+  constexpr bool time_accurate() const {
+    return BitField<BitOrder::MsbFirst, 24, 1>::Read(bytes_);
+  }
+  constexpr int hour() const {
+    return Hour::Read(bytes_);
+  }
+  constexpr int minute() const {
+    return Minute::Read(bytes_);
+  }
+  constexpr int seconds() const {
+    return Seconds::Read(bytes_);
+  }
+  // Local time offset in half hours
+  constexpr bool local_offset_negative() const {
+    return BitField<BitOrder::MsbFirst, 42, 1>::Read(bytes_);
+  }
+  constexpr int local_offset() const {
+    return BitField<BitOrder::MsbFirst, 43, 5>::Read(bytes_);
+  }
+  constexpr int modified_julian_date() const {
+    return ModifiedJulianDate::Read(bytes_);
+  }
+  constexpr std::size_t name_length() const {
+    return BitField<BitOrder::MsbFirst, 74, 4>::Read(bytes_);
+  }
+  constexpr bool has_position() const {
+    return BitField<BitOrder::LsbFirst, 80, 1>::Read(bytes_);
+  }
+
+ private:
+  ByteView bytes_;
+};
+
+}  // namespace darc2json
+
+#endif  // HEADER_VIEWS_H_
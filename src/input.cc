@@ -16,13 +16,20 @@
  */
 #include "src/input.h"
 
+#include <cerrno>
 #include <cstddef>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace darc2json {
 
 bool MPXReader::eof() const {
@@ -30,12 +37,24 @@ bool MPXReader::eof() const {
 }
 
 StdinReader::StdinReader(const Options& options)
-    : samplerate_(options.samplerate), feed_thru_(options.feed_thru) {
+    : file_(options.input_type == InputType::MpxRawFile
+                ? std::fopen(options.sndfilename.c_str(), "rb")
+                : stdin),
+      samplerate_(options.samplerate),
+      feed_thru_(options.feed_thru) {
   is_eof_ = false;
+  if (file_ == nullptr)
+    throw std::runtime_error("error: can't open input file '" + options.sndfilename + "': " +
+                             std::strerror(errno));
+}
+
+StdinReader::~StdinReader() {
+  if (file_ != stdin)
+    std::fclose(file_);
 }
 
 std::vector<float> StdinReader::ReadChunk() {
-  const int num_read = std::fread(buffer_.data(), sizeof(buffer_[0]), kInputBufferSize, stdin);
+  const int num_read = std::fread(buffer_.data(), sizeof(buffer_[0]), kInputBufferSize, file_);
 
   if (feed_thru_)
     std::fwrite(buffer_.data(), sizeof(buffer_[0]), num_read, stdout);
@@ -54,14 +73,22 @@ float StdinReader::samplerate() const {
 }
 
 SndfileReader::SndfileReader(const Options& options)
-    : info_({0, 0, 0, 0, 0, 0}), file_(::sf_open(options.sndfilename.c_str(), SFM_READ, &info_)) {
+    : info_({0, 0, 0, 0, 0, 0}),
+      file_(::sf_open(options.sndfilename.c_str(), SFM_READ, &info_)),
+      num_frames_left_(options.input_num_samples) {
   is_eof_ = false;
   if (info_.frames == 0) {
-    throw std::runtime_error("error: can't open input file");
+    throw std::runtime_error("error: can't open input file '" + options.sndfilename + "'");
   } else if (info_.samplerate < 128'000.f) {
     ::sf_close(file_);
     throw std::runtime_error("error: sample rate must be 128000 Hz or higher");
   }
+
+  if (options.input_start_sample > 0 &&
+      ::sf_seek(file_, options.input_start_sample, SEEK_SET) != options.input_start_sample) {
+    ::sf_close(file_);
+    throw std::runtime_error("error: can't seek in input file");
+  }
 }
 
 SndfileReader::~SndfileReader() {
@@ -73,11 +100,15 @@ std::vector<float> SndfileReader::ReadChunk() {
   if (is_eof_)
     return chunk;
 
-  const auto frames_to_read = kInputBufferSize / info_.channels;
+  sf_count_t frames_to_read = kInputBufferSize / info_.channels;
+  if (num_frames_left_ >= 0 && num_frames_left_ < frames_to_read)
+    frames_to_read = num_frames_left_;
 
   const sf_count_t num_read = sf_readf_float(file_, buffer_.data(), frames_to_read);
-  if (num_read != frames_to_read)
+  if (num_read != frames_to_read || num_read == num_frames_left_)
     is_eof_ = true;
+  if (num_frames_left_ >= 0)
+    num_frames_left_ -= num_read;
 
   if (info_.channels == 1) {
     chunk = std::vector<float>(buffer_.data(), buffer_.data() + num_read);
@@ -92,26 +123,162 @@ float SndfileReader::samplerate() const {
   return info_.samplerate;
 }
 
-AsciiBitReader::AsciiBitReader(const Options& options)
+// Length of the whole file
+sf_count_t SndfileReader::num_frames() const {
+  return info_.frames;
+}
+
+namespace {
+
+constexpr std::array<std::uint8_t, 256> MakeBitReversalTable() {
+  std::array<std::uint8_t, 256> table{};
+  for (int byte = 0; byte < 256; byte++)
+    for (int n_bit = 0; n_bit < 8; n_bit++)
+      table[byte] |= ((byte >> n_bit) & 1) << (7 - n_bit);
+  return table;
+}
+
+constexpr std::array<std::uint8_t, 256> kBitReversal = MakeBitReversalTable();
+
+// Appends up to 32 bits to a PackedBits, the first bit in the most significant
+// position of `value`
+void AppendBits(PackedBits& bits, std::uint32_t value, int num_new_bits) {
+  const std::size_t n_word = bits.num_bits / 64;
+  const int used           = bits.num_bits % 64;
+  if (used == 0)
+    bits.words.push_back(0);
+
+  // Left-align the new bits in a 64-bit word, then split it across the
+  // current word and the next one
+  const std::uint64_t aligned = static_cast<std::uint64_t>(value) << (64 - num_new_bits);
+  bits.words[n_word] |= aligned >> used;
+  if (used + num_new_bits > 64)
+    bits.words.push_back(aligned << (64 - used));
+
+  bits.num_bits += num_new_bits;
+}
+
+}  // namespace
+
+BitstreamReader::BitstreamReader(const Options& options)
     : is_eof_(false), feed_thru_(options.feed_thru) {}
 
-int AsciiBitReader::NextBit() {
-  int chr = 0;
-  while (chr != '0' && chr != '1' && chr != EOF) {
-    chr = std::getchar();
-    if (feed_thru_)
-      std::putchar(chr);
+bool BitstreamReader::eof() const {
+  return is_eof_;
+}
+
+std::size_t BitstreamReader::ReadChunk() {
+  const std::size_t num_read = std::fread(buffer_.data(), 1, buffer_.size(), stdin);
+  if (feed_thru_)
+    std::fwrite(buffer_.data(), 1, num_read, stdout);
+
+  if (num_read < buffer_.size())
+    is_eof_ = true;
+
+  bits_.words.clear();
+  bits_.num_bits = 0;
+
+  return num_read;
+}
+
+AsciiBitReader::AsciiBitReader(const Options& options) : BitstreamReader(options) {
+  bits_.words.reserve(kInputBufferSize / 64 + 1);
+}
+
+// Runs of 16 '0'/'1' characters are converted at once with SSE2 compares;
+// chunks containing anything else, such as line breaks, are done a character
+// at a time.
+const PackedBits& AsciiBitReader::ReadBits() {
+  const std::size_t num_read = ReadChunk();
+
+  std::size_t n_char = 0;
+#if defined(__SSE2__)
+  const __m128i zeros = _mm_set1_epi8('0');
+  const __m128i ones  = _mm_set1_epi8('1');
+  for (; n_char + 16 <= num_read; n_char += 16) {
+    const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&buffer_[n_char]));
+    const int is_one    = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, ones));
+    const int is_zero   = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, zeros));
+
+    if ((is_one | is_zero) == 0xFFFF) {
+      // Mask bit 0 is the first character, which goes to the most significant bit
+      AppendBits(bits_, (kBitReversal[is_one & 0xFF] << 8) | kBitReversal[is_one >> 8], 16);
+    } else {
+      for (std::size_t n = n_char; n < n_char + 16; n++)
+        if (buffer_[n] == '0' || buffer_[n] == '1')
+          AppendBits(bits_, buffer_[n] == '1', 1);
+    }
+  }
+#endif
+
+  for (; n_char < num_read; n_char++)
+    if (buffer_[n_char] == '0' || buffer_[n_char] == '1')
+      AppendBits(bits_, buffer_[n_char] == '1', 1);
+
+  return bits_;
+}
+
+PackedBitReader::PackedBitReader(const Options& options) : BitstreamReader(options) {
+  bits_.words.reserve(kInputBufferSize / 8 + 1);
+}
+
+const PackedBits& PackedBitReader::ReadBits() {
+  const std::size_t num_read = ReadChunk();
+
+  bits_.words.resize((num_read + 7) / 8);
+  for (std::size_t n_byte = 0; n_byte < num_read; n_byte++) {
+    const auto byte = static_cast<std::uint8_t>(buffer_[n_byte]);
+    bits_.words[n_byte / 8] |= static_cast<std::uint64_t>(byte) << (56 - 8 * (n_byte % 8));
   }
+  bits_.num_bits = num_read * 8;
+
+  return bits_;
+}
+
+HexBlockReader::HexBlockReader(const Options& options)
+    : buffer_(kInputBufferSize), block_(BIC1), is_eof_(false), feed_thru_(options.feed_thru) {}
+
+// Malformed lines are skipped; the blocks they held are counted as missing
+// by the gap in stream positions.
+void HexBlockReader::ReadBlocks(const L2BlockSink& sink) {
+  // A line longer than the whole buffer can't be a block
+  if (num_buffered_ == buffer_.size())
+    num_buffered_ = 0;
 
-  if (chr == EOF) {
+  const std::size_t num_read =
+      std::fread(buffer_.data() + num_buffered_, 1, buffer_.size() - num_buffered_, stdin);
+  if (feed_thru_)
+    std::fwrite(buffer_.data() + num_buffered_, 1, num_read, stdout);
+
+  if (num_read == 0)
     is_eof_ = true;
-    return 0;
+
+  const char* const data = buffer_.data();
+  const std::size_t size = num_buffered_ + num_read;
+  std::size_t line_start = 0;
+  while (line_start < size) {
+    const void* newline = std::memchr(data + line_start, '\n', size - line_start);
+    if (newline == nullptr && !is_eof_)
+      break;
+
+    const std::size_t line_end =
+        newline == nullptr ? size : static_cast<const char*>(newline) - data;
+    std::string_view line(data + line_start, line_end - line_start);
+    if (!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+
+    if (ParseL2BlockHex(line, block_))
+      sink(block_);
+
+    line_start = line_end + 1;
   }
 
-  return (chr == '1');
+  num_buffered_ = (line_start < size ? size - line_start : 0);
+  if (num_buffered_ > 0)
+    std::memmove(buffer_.data(), data + line_start, num_buffered_);
 }
 
-bool AsciiBitReader::eof() const {
+bool HexBlockReader::eof() const {
   return is_eof_;
 }
 
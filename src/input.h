@@ -18,11 +18,14 @@
 #define INPUT_H_
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <vector>
 
 #include "config.h"
 #include "src/common.h"
+#include "src/layer2.h"
 
 #include <sndfile.h>
 
@@ -30,6 +33,7 @@ namespace darc2json {
 
 class MPXReader {
  public:
+  virtual ~MPXReader() = default;
   bool eof() const;
   virtual std::vector<float> ReadChunk() = 0;
   virtual float samplerate() const       = 0;
@@ -38,16 +42,21 @@ class MPXReader {
   bool is_eof_;
 };
 
+// Raw 16-bit MPX from stdin, or from a FIFO or other unseekable file if the
+// input type is MpxRawFile
 class StdinReader : public MPXReader {
  public:
   explicit StdinReader(const Options& options);
-  ~StdinReader() = default;
+  ~StdinReader();
+  StdinReader(const StdinReader&)            = delete;
+  StdinReader& operator=(const StdinReader&) = delete;
   std::vector<float> ReadChunk() override;
   float samplerate() const override;
 
  private:
   static constexpr int kInputBufferSize = 4096;
 
+  std::FILE* file_;
   float samplerate_;
   std::array<std::int16_t, kInputBufferSize> buffer_;
   bool feed_thru_;
@@ -59,23 +68,77 @@ class SndfileReader : public MPXReader {
   ~SndfileReader();
   std::vector<float> ReadChunk() override;
   float samplerate() const override;
+  sf_count_t num_frames() const;
 
  private:
   static constexpr int kInputBufferSize = 4096;
 
   SF_INFO info_;
   SNDFILE* file_;
+  // Frames left to read, or -1 for all of them
+  sf_count_t num_frames_left_;
   std::array<float, kInputBufferSize> buffer_;
 };
 
-class AsciiBitReader {
+// Bits packed MSB-first into 64-bit words, as taken by Layer2::PushPackedBits
+struct PackedBits {
+  std::vector<std::uint64_t> words;
+  std::size_t num_bits{};
+};
+
+// Demodulated bitstreams read from stdin in large chunks
+class BitstreamReader {
+ public:
+  virtual ~BitstreamReader() = default;
+  bool eof() const;
+  virtual const PackedBits& ReadBits() = 0;
+
+ protected:
+  static constexpr std::size_t kInputBufferSize = 1 << 16;
+
+  explicit BitstreamReader(const Options& options);
+
+  // Read the next chunk of stdin into buffer_ and echo it if feed_thru_ is set
+  std::size_t ReadChunk();
+
+  std::array<char, kInputBufferSize> buffer_;
+  PackedBits bits_;
+  bool is_eof_;
+  bool feed_thru_;
+};
+
+// ASCII '0' and '1' characters; everything else is ignored
+class AsciiBitReader : public BitstreamReader {
  public:
   explicit AsciiBitReader(const Options& options);
   ~AsciiBitReader() = default;
-  int NextBit();
+  const PackedBits& ReadBits() override;
+};
+
+// Raw binary, 8 bits per byte, most significant bit first
+class PackedBitReader : public BitstreamReader {
+ public:
+  explicit PackedBitReader(const Options& options);
+  ~PackedBitReader() = default;
+  const PackedBits& ReadBits() override;
+};
+
+// Reads L2 blocks dumped with --output hex, one per line. Input is read in
+// large chunks and parsed in place.
+class HexBlockReader {
+ public:
+  explicit HexBlockReader(const Options& options);
+  ~HexBlockReader() = default;
+  void ReadBlocks(const L2BlockSink& sink);
   bool eof() const;
 
  private:
+  static constexpr std::size_t kInputBufferSize = 1 << 16;
+
+  std::vector<char> buffer_;
+  // Bytes at the start of the buffer left over from an incomplete line
+  std::size_t num_buffered_{};
+  L2Block block_;
   bool is_eof_;
   bool feed_thru_;
 };
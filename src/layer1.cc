@@ -16,13 +16,15 @@
  */
 #include "src/layer1.h"
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 #include <complex>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
-#include <deque>
 #include <iostream>
+#include <memory>
 #include <vector>
 
 #include <sndfile.h>
@@ -30,6 +32,7 @@
 #include "src/common.h"
 #include "src/input.h"
 #include "src/liquid_wrappers.h"
+#include "src/util.h"
 
 namespace darc2json {
 
@@ -42,6 +45,9 @@ constexpr float kAGCBandwidth_Hz     = 500.0f;
 constexpr float kAGCInitialGain      = 0.0077f;
 constexpr float kLowpassCutoff_Hz    = 11'000.0f;
 constexpr float kPLLBandwidth_Hz     = 0.01f;
+// Soft bit value of an average-strength bit
+constexpr float kSoftBitNominal      = 32.0f;
+constexpr float kSoftBitAveraging    = 1.0f / 256.0f;
 
 constexpr float hertz2step(float Hz) {
   return Hz * 2.0f * M_PI / kTargetSampleRate_Hz;
@@ -60,13 +66,14 @@ Subcarrier::Subcarrier(const Options& options)
       resampler_(resample_ratio_, 13),
       freqdem_(0.5f),
       is_eof_(false),
-      accumulator_(0.f) {
+      accumulator_(0.f),
+      mean_magnitude_(0.f) {
   oscillator_dataclock_.setPLLBandwidth(kPLLBandwidth_Hz / kTargetSampleRate_Hz);
 
   if (options.input_type == InputType::MpxSndfile) {
-    mpx_ = new SndfileReader(options);
+    mpx_ = std::make_unique<SndfileReader>(options);
   } else {
-    mpx_ = new StdinReader(options);
+    mpx_ = std::make_unique<StdinReader>(options);
   }
 
   resample_ratio_ = kTargetSampleRate_Hz / mpx_->samplerate();
@@ -85,13 +92,29 @@ float Subcarrier::nyquist() const {
   return kTargetSampleRate_Hz * .5f;
 }
 
+// Scale the integrated symbol to a soft bit relative to its running average
+// magnitude. The sign is kept even for the weakest bits, and demodulated bits
+// are never as reliable as a hard decision.
+SoftBit Subcarrier::QuantizeSoftBit(float integrated) {
+  const float magnitude = std::fabs(integrated);
+  mean_magnitude_ += (magnitude - mean_magnitude_) * kSoftBitAveraging;
+
+  const float scaled =
+      (mean_magnitude_ > 0.f ? magnitude / mean_magnitude_ * kSoftBitNominal : kSoftBitNominal);
+  const int reliability = std::min(std::max(static_cast<int>(scaled), 1), kSoftBitMax - 1);
+
+  return static_cast<SoftBit>(integrated > 0.f ? reliability : -reliability);
+}
+
 void Subcarrier::DemodulateMoreBits() {
   is_eof_ = mpx_->eof();
   if (is_eof_)
     return;
 
-  const std::vector<float> inbuffer = mpx_->ReadChunk();
+  DemodulateSamples(mpx_->ReadChunk());
+}
 
+void Subcarrier::DemodulateSamples(const std::vector<float>& inbuffer) {
   int num_samples = 0;
 
   std::vector<std::complex<float>> complex_samples(
@@ -129,7 +152,8 @@ void Subcarrier::DemodulateMoreBits() {
 
       accumulator_ += fmdem * std::fabs(oscillator_dataclock_.cos());
       if (oscillator_dataclock_.DidCrossZero()) {
-        bit_buffer_.push_back(accumulator_ > 0.f);
+        bit_buffer_.push_back(QuantizeSoftBit(accumulator_));
+        bit_sample_positions_.push_back(sample_num_);
         accumulator_ = 0.f;
       }
     }
@@ -141,21 +165,57 @@ void Subcarrier::DemodulateMoreBits() {
   }
 }
 
-int Subcarrier::NextBit() {
-  while (bit_buffer_.size() < 1 && !eof()) DemodulateMoreBits();
-
-  int bit = 0;
+// Demodulate at least one bit, unless at end of input. The returned buffer is
+// reused by the next call.
+const SoftBits& Subcarrier::ReadBits() {
+  bit_buffer_.clear();
+  bit_sample_positions_.clear();
+  while (bit_buffer_.empty() && !eof()) DemodulateMoreBits();
 
-  if (bit_buffer_.size() > 0) {
-    bit = bit_buffer_.front();
-    bit_buffer_.pop_front();
-  }
-
-  return bit;
+  return bit_buffer_;
 }
 
 bool Subcarrier::eof() const {
   return is_eof_;
 }
 
+std::vector<float> Subcarrier::ReadSamples() {
+  return mpx_->ReadChunk();
+}
+
+bool Subcarrier::input_eof() const {
+  return mpx_->eof();
+}
+
+// Demodulate samples from ReadSamples(). The returned buffer is reused by the
+// next call.
+const SoftBits& Subcarrier::Demodulate(const std::vector<float>& samples) {
+  bit_buffer_.clear();
+  bit_sample_positions_.clear();
+  DemodulateSamples(samples);
+  return bit_buffer_;
+}
+
+const std::vector<std::uint64_t>& Subcarrier::bit_sample_positions() const {
+  return bit_sample_positions_;
+}
+
+// Number of samples demodulated so far, at the target sample rate
+std::uint64_t Subcarrier::sample_num() const {
+  return sample_num_;
+}
+
+float Subcarrier::agc_gain() {
+  return agc_.gain();
+}
+
+float Subcarrier::input_samplerate() const {
+  return mpx_->samplerate();
+}
+
+// Running average of the integrated symbol magnitude, the scale of soft bits
+float Subcarrier::mean_magnitude() const {
+  return mean_magnitude_;
+}
+
 }  // namespace darc2json
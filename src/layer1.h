@@ -18,13 +18,16 @@
 #define LAYER1_H_
 
 #include <complex>
-#include <deque>
+#include <cstdint>
+#include <memory>
+#include <vector>
 
 #include "config.h"
 
 #include "src/common.h"
 #include "src/input.h"
 #include "src/liquid_wrappers.h"
+#include "src/util.h"
 
 namespace darc2json {
 
@@ -32,17 +35,31 @@ class Subcarrier {
  public:
   explicit Subcarrier(const Options& options);
   ~Subcarrier() = default;
-  int NextBit();
+  const SoftBits& ReadBits();
   bool eof() const;
+  // ReadBits() in two steps, which may run on different threads
+  std::vector<float> ReadSamples();
+  bool input_eof() const;
+  const SoftBits& Demodulate(const std::vector<float>& samples);
+  // Sample number at which each bit of the last ReadBits() or Demodulate() was
+  // received
+  const std::vector<std::uint64_t>& bit_sample_positions() const;
+  std::uint64_t sample_num() const;
+  float agc_gain();
+  float mean_magnitude() const;
+  float input_samplerate() const;
 
  private:
   void DemodulateMoreBits();
+  void DemodulateSamples(const std::vector<float>& inbuffer);
+  SoftBit QuantizeSoftBit(float integrated);
   float nyquist() const;
 
-  int sample_num_;
+  std::uint64_t sample_num_;
   float resample_ratio_;
 
-  std::deque<int> bit_buffer_;
+  SoftBits bit_buffer_;
+  std::vector<std::uint64_t> bit_sample_positions_;
 
   liquid::FIRFilter fir_lpf_;
   liquid::AGC agc_;
@@ -53,10 +70,11 @@ class Subcarrier {
 
   bool is_eof_;
   float accumulator_;
+  float mean_magnitude_;
 
   std::complex<float> prev_sym_;
 
-  MPXReader* mpx_;
+  std::unique_ptr<MPXReader> mpx_;
 };
 
 }  // namespace darc2json
@@ -16,11 +16,19 @@
  */
 #include "src/layer2.h"
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
-#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "src/util.h"
 
@@ -31,12 +39,102 @@ constexpr std::uint16_t kBic2 = 0x74A6;
 constexpr std::uint16_t kBic3 = 0xA791;
 constexpr std::uint16_t kBic4 = 0xC875;
 
-const Bits kL2CRC = poly_coeffs_to_bits({14, 11, 2, 0});
-const Bits kL2HorizontalParity =
-    poly_coeffs_to_bits({82, 77, 76, 71, 67, 66, 56, 52, 48, 40, 36, 34, 24, 22, 18, 10, 4, 0});
+constexpr std::array<std::uint16_t, 4> kBics({kBic1, kBic2, kBic3, kBic4});
 
-const std::map<Bits, Bits> parity_syndrome_errors =
-    create_bitflip_syndrome_map(272, kL2HorizontalParity);
+constexpr CrcPolynomial kL2CRC = CrcPolynomialFromCoeffs({14, 11, 2, 0});
+
+namespace {
+
+// Generator polynomial of the horizontal parity, without the x^82 term
+constexpr Syndrome kL2HorizontalParity = [] {
+  constexpr std::array<int, 17> coeffs(
+      {77, 76, 71, 67, 66, 56, 52, 48, 40, 36, 34, 24, 22, 18, 10, 4, 0});
+  Syndrome poly{};
+  for (const int c : coeffs) poly[c / 64] |= std::uint64_t{1} << (c % 64);
+  return poly;
+}();
+
+constexpr void XorInto(Syndrome& syndrome, const Syndrome& other) {
+  syndrome[0] ^= other[0];
+  syndrome[1] ^= other[1];
+}
+
+constexpr bool IsZero(const Syndrome& syndrome) {
+  return syndrome[0] == 0 && syndrome[1] == 0;
+}
+
+// Syndrome of a single bit error at each position of the block
+constexpr std::array<Syndrome, 272> CreateBitSyndromes() {
+  std::array<Syndrome, 272> syndromes{};
+  Syndrome syndrome{1, 0};
+  for (int n_bit = 271; n_bit >= 0; n_bit--) {
+    syndromes[n_bit] = syndrome;
+
+    // Multiply by x, modulo the generator
+    const bool overflow = (syndrome[1] >> 17) & 1;
+    syndrome[1]         = ((syndrome[1] << 1) | (syndrome[0] >> 63)) & 0x3FFFF;
+    syndrome[0] <<= 1;
+    if (overflow)
+      XorInto(syndrome, kL2HorizontalParity);
+  }
+
+  return syndromes;
+}
+
+constexpr std::array<Syndrome, 272> kBitSyndromes = CreateBitSyndromes();
+
+// Syndrome of each value of each 4-bit group of the block, so that the
+// syndrome of a whole block takes 68 lookups
+constexpr std::array<std::array<Syndrome, 16>, 68> CreateNibbleSyndromes() {
+  std::array<std::array<Syndrome, 16>, 68> syndromes{};
+  for (std::size_t n_nibble = 0; n_nibble < 68; n_nibble++)
+    for (int value = 0; value < 16; value++)
+      for (int n_bit = 0; n_bit < 4; n_bit++)
+        if ((value >> n_bit) & 1)
+          XorInto(syndromes[n_nibble][value], kBitSyndromes[n_nibble * 4 + n_bit]);
+  return syndromes;
+}
+
+constexpr std::array<std::array<Syndrome, 16>, 68> kNibbleSyndromes = CreateNibbleSyndromes();
+
+struct SyndromeErrorPosition {
+  Syndrome syndrome;
+  int position;
+};
+
+constexpr bool SyndromeLess(const Syndrome& a, const Syndrome& b) {
+  return a[1] != b[1] ? a[1] < b[1] : a[0] < b[0];
+}
+
+// Single bit error syndromes sorted for binary search (std::sort isn't
+// constexpr in C++17, so this is an insertion sort)
+constexpr std::array<SyndromeErrorPosition, 272> CreateSyndromeErrorPositions() {
+  std::array<SyndromeErrorPosition, 272> result{};
+  for (int n_bit = 0; n_bit < 272; n_bit++) {
+    int n = n_bit;
+    while (n > 0 && SyndromeLess(kBitSyndromes[n_bit], result[n - 1].syndrome)) {
+      result[n] = result[n - 1];
+      n--;
+    }
+    result[n] = {kBitSyndromes[n_bit], n_bit};
+  }
+  return result;
+}
+
+constexpr std::array<SyndromeErrorPosition, 272> kSyndromeErrorPositions =
+    CreateSyndromeErrorPositions();
+
+// \return Position of the single bit error that causes this syndrome, or -1
+int ErrorPosition(const Syndrome& syndrome) {
+  const auto it = std::lower_bound(
+      kSyndromeErrorPositions.cbegin(), kSyndromeErrorPositions.cend(), syndrome,
+      [](const SyndromeErrorPosition& entry, const Syndrome& value) {
+        return SyndromeLess(entry.syndrome, value);
+      });
+  return (it != kSyndromeErrorPositions.cend() && it->syndrome == syndrome) ? it->position : -1;
+}
+
+}  // namespace
 
 bool IsValidBic(std::uint16_t word) {
   return (word == kBic1 || word == kBic2 || word == kBic3 || word == kBic4);
@@ -53,28 +151,194 @@ eBic BicFor(std::uint16_t word) {
     return BIC4;
 }
 
-Descrambler::Descrambler() {
+namespace {
+
+// The scrambling sequence as it applies to one L2 block, packed like the
+// block bits
+constexpr std::array<std::uint8_t, L2Block::kNumBytes> MakeScrambleSequence() {
   constexpr std::array<std::uint16_t, 19> seq_words(
       {0xafaa, 0x814a, 0xf2ee, 0x073a, 0x4f5d, 0x4486, 0x70bd, 0xb343, 0xbc3f, 0xe0f7, 0xc5cc,
        0x8253, 0xb479, 0xf362, 0xa471, 0xb571, 0x3110, 0x0846, 0x1390});
 
-  for (std::size_t n_word = 0; n_word < seq_words.size(); n_word++)
-    for (int n_bit = 0; n_bit < 16; n_bit++)
-      sequence_[16 * n_word + n_bit] = (seq_words[n_word] >> (15 - n_bit)) & 1;
+  std::array<std::uint8_t, L2Block::kNumBytes> sequence{};
+  for (std::size_t n_bit = 0; n_bit < 272; n_bit++) {
+    const int bit = (seq_words[n_bit / 16] >> (15 - n_bit % 16)) & 1;
+    sequence[n_bit / 8] |= bit << (n_bit % 8);
+  }
+  return sequence;
 }
 
-int Descrambler::Descramble(int bit) {
-  const int result = bit ^ sequence_[bit_counter_];
-  bit_counter_++;
-  return result;
+constexpr std::array<std::uint8_t, L2Block::kNumBytes> kScrambleSequence = MakeScrambleSequence();
+
+int ScrambleBit(std::size_t n) {
+  return (kScrambleSequence[n / 8] >> (n % 8)) & 1;
+}
+
+// Bit n of a packed MSB-first buffer
+int PackedBit(const std::uint64_t* words, std::size_t n) {
+  return (words[n / 64] >> (63 - n % 64)) & 1;
+}
+
+// The 16 bits ending at (and including) bit n
+std::uint16_t PackedWindow(const std::uint64_t* words, std::size_t n) {
+  const std::size_t first = n - 15;
+  const int shift         = first % 64;
+  std::uint64_t window    = words[first / 64] << shift;
+  if (shift > 48)
+    window |= words[first / 64 + 1] >> (64 - shift);
+  return window >> 48;
+}
+
+// Add a 64-lane bit vector to bit-sliced 5-bit lane counters
+void AddToLaneCounters(std::array<std::uint64_t, 5>& counters, std::uint64_t lanes) {
+  for (std::uint64_t& counter : counters) {
+    const std::uint64_t carry = counter & lanes;
+    counter ^= lanes;
+    lanes = carry;
+  }
 }
 
-L2Block::L2Block(eBic _bic) : bic_(_bic), bits_(272) {}
+// Lanes whose counter value is <= limit
+std::uint64_t LanesAtMost(const std::array<std::uint64_t, 5>& counters, int limit) {
+  std::uint64_t less  = 0;
+  std::uint64_t equal = ~0ULL;
+  for (int n_bit = 4; n_bit >= 0; n_bit--) {
+    if ((limit >> n_bit) & 1) {
+      less |= equal & ~counters[n_bit];
+      equal &= counters[n_bit];
+    } else {
+      equal &= ~counters[n_bit];
+    }
+  }
+  return less | equal;
+}
+
+}  // namespace
+
+// The buffer is processed 64 bit offsets at a time. Offset t of a word is lane
+// (63 - t) in a set of bit planes, where plane j holds the j'th bit of the
+// 16-bit window at each offset. XORing the planes with the BIC gives per-lane
+// mismatches that are summed in bit-sliced counters; exact popcounts are only
+// computed for the few offsets that pass the threshold.
+void CorrelateBics(const std::uint64_t* words, std::size_t num_bits, int max_distance,
+                   std::vector<BicCandidate>& candidates) {
+  if (num_bits < 16)
+    return;
+
+  const std::size_t last_offset = num_bits - 16;
+  const std::size_t num_words   = (num_bits + 63) / 64;
+
+  for (std::size_t n_word = 0; n_word * 64 <= last_offset; n_word++) {
+    const std::uint64_t current = words[n_word];
+    const std::uint64_t next    = (n_word + 1 < num_words ? words[n_word + 1] : 0);
+
+    std::array<std::uint64_t, 16> planes;
+    planes[0] = current;
+    for (int j = 1; j < 16; j++) planes[j] = (current << j) | (next >> (64 - j));
+
+    std::uint64_t matches = 0;
+    for (const std::uint16_t bic : kBics) {
+      if (max_distance == 0) {
+        std::uint64_t mismatch = 0;
+        for (int j = 0; j < 16; j++) mismatch |= planes[j] ^ -((bic >> (15 - j)) & 1ULL);
+        matches |= ~mismatch;
+      } else {
+        std::array<std::uint64_t, 5> counters{};
+        for (int j = 0; j < 16; j++)
+          AddToLaneCounters(counters, planes[j] ^ -((bic >> (15 - j)) & 1ULL));
+        matches |= LanesAtMost(counters, max_distance);
+      }
+    }
+
+    // Drop lanes whose window would run past the end of the buffer
+    const std::size_t lanes_valid = last_offset - n_word * 64 + 1;
+    if (lanes_valid < 64)
+      matches &= ~0ULL << (64 - lanes_valid);
+
+    while (matches != 0) {
+      const int lane           = __builtin_clzll(matches);
+      const std::size_t offset = n_word * 64 + lane;
+      const std::uint16_t word = PackedWindow(words, offset + 15);
+      BicCandidate best{offset + 16, BIC1, 17};
+      for (std::size_t n_bic = 0; n_bic < kBics.size(); n_bic++) {
+        const int distance = __builtin_popcount(word ^ kBics[n_bic]);
+        if (distance < best.distance) {
+          best.bic      = static_cast<eBic>(n_bic);
+          best.distance = distance;
+        }
+      }
+      candidates.push_back(best);
+      matches &= ~(1ULL << (63 - lane));
+    }
+  }
+}
+
+L2Block::L2Block(eBic _bic, int num_chase_bits)
+    : bic_(_bic), num_chase_bits_(std::min(num_chase_bits, kMaxChaseBits)) {}
+
+// Start receiving a new block
+void L2Block::Reset(eBic bic, std::uint64_t start_position) {
+  bic_            = bic;
+  bit_counter_    = 0;
+  start_position_ = start_position;
+  is_corrected_   = false;
+  num_weak_bits_  = 0;
+  bytes_.fill(0);
+}
+
+void L2Block::PushBit(SoftBit bit) {
+  if (bit_counter_ < 272) {
+    bytes_[bit_counter_ / 8] |= (bit > 0) << (bit_counter_ % 8);
+
+    const int reliability = std::abs(bit);
+    if (reliability < kSoftBitMax)
+      TrackWeakBit(bit_counter_, reliability);
 
-void L2Block::PushBit(int bit) {
-  if (bit_counter_ < bits_.size()) {
-    bits_[bit_counter_] = descrambler_.Descramble(bit);
     bit_counter_++;
+
+    if (complete())
+      Descramble();
+  }
+}
+
+// Load a block that was decoded earlier, e.g. from a hex dump
+void L2Block::Restore(eBic bic, std::uint64_t start_position, bool is_corrected,
+                      ByteView information_bytes) {
+  Reset(bic, start_position);
+  is_corrected_ = is_corrected;
+  bit_counter_  = 272;
+  std::copy(information_bytes.begin(), information_bytes.end(), bytes_.begin());
+}
+
+// XOR with the scrambling sequence, a word at a time
+void L2Block::Descramble() {
+  for (std::size_t n_byte = 0; n_byte < kNumBytes; n_byte += sizeof(std::uint64_t)) {
+    std::uint64_t word;
+    std::uint64_t sequence_word;
+    std::memcpy(&word, &bytes_[n_byte], sizeof(word));
+    std::memcpy(&sequence_word, &kScrambleSequence[n_byte], sizeof(sequence_word));
+    word ^= sequence_word;
+    std::memcpy(&bytes_[n_byte], &word, sizeof(word));
+  }
+}
+
+// Keep the num_chase_bits_ least reliable bits
+void L2Block::TrackWeakBit(std::size_t position, int reliability) {
+  if (num_chase_bits_ == 0)
+    return;
+
+  if (num_weak_bits_ < num_chase_bits_) {
+    weak_bits_[num_weak_bits_] = {static_cast<std::uint16_t>(position),
+                                  static_cast<std::uint8_t>(reliability)};
+    if (num_weak_bits_ == 0 || reliability > weak_bits_[strongest_weak_bit_].reliability)
+      strongest_weak_bit_ = num_weak_bits_;
+    num_weak_bits_++;
+  } else if (reliability < weak_bits_[strongest_weak_bit_].reliability) {
+    weak_bits_[strongest_weak_bit_] = {static_cast<std::uint16_t>(position),
+                                       static_cast<std::uint8_t>(reliability)};
+    for (int n = 0; n < num_weak_bits_; n++)
+      if (weak_bits_[n].reliability > weak_bits_[strongest_weak_bit_].reliability)
+        strongest_weak_bit_ = n;
   }
 }
 
@@ -86,50 +350,420 @@ int L2Block::BicNum() const {
   return bic_ + 1;
 }
 
-Bits L2Block::information_bits() const {
-  return Bits(bits_.begin(), bits_.begin() + 176);
+int L2Block::bit(std::size_t position) const {
+  return (bytes_[position / 8] >> (position % 8)) & 1;
+}
+
+// The 176 information bits, packed LSB-first
+ByteView L2Block::information_bytes() const {
+  return ByteView(bytes_.data(), 176 / 8);
+}
+
+// Index of the first bit after the BIC, counted from the start of the stream
+std::uint64_t L2Block::start_position() const {
+  return start_position_;
+}
+
+// Sample number at which the last bit of the block was received
+std::uint64_t L2Block::sample_position() const {
+  return sample_position_;
+}
+
+void L2Block::set_sample_position(std::uint64_t sample_position) {
+  sample_position_ = sample_position;
+}
+
+// True if any bits were flipped to make the CRC check out
+bool L2Block::is_corrected() const {
+  return is_corrected_;
+}
+
+Syndrome L2Block::syndrome() const {
+  Syndrome result{};
+  for (std::size_t n_nibble = 0; n_nibble < 68; n_nibble++)
+    XorInto(result, kNibbleSyndromes[n_nibble][(bytes_[n_nibble / 2] >> (n_nibble % 2 * 4)) & 0xF]);
+  return result;
+}
+
+void L2Block::FlipBit(std::size_t position) {
+  bytes_[position / 8] ^= 1 << (position % 8);
+}
+
+// Chase decoding: flip every combination of the least reliable bits, follow
+// each with a single-bit correction if the syndrome calls for one, and keep the
+// combination that flips the least total reliability. Combinations are visited
+// in Gray code order so that each step changes the syndrome by one bit's worth.
+bool L2Block::ChaseDecode(Syndrome syndrome) {
+  const unsigned int num_combinations = 1U << num_weak_bits_;
+
+  int best_score          = std::numeric_limits<int>::max();
+  unsigned int best_flips = 0;
+  int best_extra_flip     = -1;
+  unsigned int flips      = 0;
+  int score               = 0;
+
+  for (unsigned int n = 1; n < num_combinations; n++) {
+    const int n_weak    = __builtin_ctz(n);
+    const WeakBit& weak = weak_bits_[n_weak];
+    flips ^= 1U << n_weak;
+    score += ((flips >> n_weak) & 1) ? weak.reliability : -weak.reliability;
+    XorInto(syndrome, kBitSyndromes[weak.position]);
+
+    if (IsZero(syndrome)) {
+      if (score < best_score) {
+        best_score      = score;
+        best_flips      = flips;
+        best_extra_flip = -1;
+      }
+    } else if (score + kSoftBitMax < best_score) {
+      const int error_position = ErrorPosition(syndrome);
+      if (error_position >= 0) {
+        best_score      = score + kSoftBitMax;
+        best_flips      = flips;
+        best_extra_flip = error_position;
+      }
+    }
+  }
+
+  if (best_score == std::numeric_limits<int>::max())
+    return false;
+
+  for (int n_weak = 0; n_weak < num_weak_bits_; n_weak++)
+    if ((best_flips >> n_weak) & 1)
+      FlipBit(weak_bits_[n_weak].position);
+  if (best_extra_flip >= 0)
+    FlipBit(best_extra_flip);
+
+  return true;
+}
+
+// Correct a single bit error if the syndrome points to one
+bool L2Block::CorrectSyndrome(const Syndrome& syndrome) {
+  if (IsZero(syndrome))
+    return true;
+
+  const int error_position = ErrorPosition(syndrome);
+  if (error_position >= 0)
+    FlipBit(error_position);
+
+  return error_position >= 0;
 }
 
 bool L2Block::crc_ok() {
-  const Bits syndrome = crc(bits_, kL2HorizontalParity, 176 + 14 + 82);
+  const Syndrome syndrome = this->syndrome();
 
-  bool is_ok = AllBitsZero(syndrome);
+  bool is_ok = IsZero(syndrome);
 
   if (!is_ok) {
-    if (parity_syndrome_errors.count(syndrome) != 0) {
-      const Bits evector = parity_syndrome_errors.at(syndrome);
-      for (std::size_t i = 0; i < evector.size(); i++) {
-        bits_[i] ^= evector[i];
+    is_ok         = CorrectSyndrome(syndrome) || ChaseDecode(syndrome);
+    is_ok         = is_ok && IsZero(this->syndrome());
+    is_corrected_ = is_ok;
+  }
+
+  return is_ok;
+}
+
+// If the clock slips, a bit may be lost or gained inside a block, and all the
+// bits after it end up at the wrong position and descrambled with the wrong
+// sequence bit. Try the slip at every position, with a single-bit correction on
+// top, and realign the block to the first position that checks out. Moving the
+// slip by one position only moves one bit, so each hypothesis updates the
+// syndrome with two table lookups.
+// \param slip -1 if a bit was lost (the next BIC came one bit early), +1 if a
+//              bit was gained (the next BIC came one bit late)
+// \param next_bit The raw bit that followed the block
+bool L2Block::RecoverSlip(int slip, int next_bit) {
+  assert(complete());
+
+  // Bits as received, before descrambling
+  auto raw = [this, next_bit](std::size_t n) {
+    return n < 272 ? bit(n) ^ ScrambleBit(n) : next_bit;
+  };
+  // Syndrome contribution of raw bit n if it belongs at position m
+  auto add = [&raw](Syndrome& syndrome, std::size_t n, std::size_t m) {
+    if (raw(n) ^ ScrambleBit(m))
+      XorInto(syndrome, kBitSyndromes[m]);
+  };
+
+  std::array<std::uint8_t, kNumBytes> realigned{};
+  auto set = [&realigned](std::size_t m, int value) {
+    realigned[m / 8] |= value << (m % 8);
+  };
+
+  Syndrome syndrome{};
+
+  if (slip < 0) {
+    // Bit p was lost: the block ran one bit into the next BIC
+    for (std::size_t n = 0; n < 271; n++) add(syndrome, n, n + 1);
+
+    for (std::size_t p = 0; p < 272; p++) {
+      if (p > 0) {
+        add(syndrome, p - 1, p);
+        add(syndrome, p - 1, p - 1);
       }
 
-      is_ok = AllBitsZero(crc(bits_, kL2HorizontalParity, 176 + 14 + 82));
+      for (int lost_bit = 0; lost_bit <= 1; lost_bit++) {
+        Syndrome hypothesis = syndrome;
+        if (lost_bit)
+          XorInto(hypothesis, kBitSyndromes[p]);
+
+        if (IsZero(hypothesis) || ErrorPosition(hypothesis) >= 0) {
+          for (std::size_t m = 0; m < 272; m++)
+            set(m, m < p ? bit(m) : m == p ? lost_bit : raw(m - 1) ^ ScrambleBit(m));
+          bytes_        = realigned;
+          is_corrected_ = true;
+          return CorrectSyndrome(hypothesis);
+        }
+      }
+    }
+  } else {
+    // Bit p was gained: the last bit of the block is the one that followed it
+    for (std::size_t n = 1; n < 273; n++) add(syndrome, n, n - 1);
+
+    for (std::size_t p = 0; p < 273; p++) {
+      if (p > 0) {
+        add(syndrome, p - 1, p - 1);
+        add(syndrome, p, p - 1);
+      }
+
+      if (IsZero(syndrome) || ErrorPosition(syndrome) >= 0) {
+        for (std::size_t m = 0; m < 272; m++)
+          set(m, m < p ? bit(m) : raw(m + 1) ^ ScrambleBit(m));
+        bytes_        = realigned;
+        is_corrected_ = true;
+        return CorrectSyndrome(syndrome);
+      }
     }
   }
 
-  return is_ok;
+  return false;
 }
 
-Layer2::Layer2() : bic_register_(0x0000), block_(BicFor(bic_register_)) {}
+std::uint64_t NominalSamplePosition(std::uint64_t bit_position) {
+  return static_cast<std::uint64_t>(std::llround((bit_position + 1) * kSamplesPerBit));
+}
 
-std::vector<L2Block> Layer2::PushBit(int bit) {
-  std::vector<L2Block> blocks;
+Layer2::Layer2(const Options& options)
+    : bic_register_(0x0000), block_(BicFor(bic_register_), options.chase_bits) {}
 
-  if (in_sync_) {
-    block_.PushBit(bit);
-    if (block_.complete()) {
-      if (block_.crc_ok())
-        blocks.push_back(block_);
-      in_sync_ = false;
+void Layer2::PushSyncedBit(SoftBit bit, const L2BlockSink& sink) {
+  bic_register_ = (bic_register_ << 1) + (bit > 0);
+  block_.PushBit(bit);
+  if (block_.complete()) {
+    block_.set_sample_position(sample_position());
+    if (block_.crc_ok()) {
+      sink(block_);
+    } else {
+      has_failed_block_ = true;
+      failed_block_end_ = bit_position_ + 1;
     }
-  } else {
-    bic_register_ = (bic_register_ << 1) + bit;
-    if (IsValidBic(bic_register_)) {
-      block_   = L2Block(BicFor(bic_register_));
-      in_sync_ = true;
+    in_sync_ = false;
+  }
+}
+
+void Layer2::PushUnsyncedBit(int bit, const L2BlockSink& sink) {
+  if (has_failed_block_ && bit_position_ == failed_block_end_)
+    bit_after_failed_block_ = bit;
+
+  bic_register_ = (bic_register_ << 1) + bit;
+  if (IsValidBic(bic_register_))
+    StartBlock(BicFor(bic_register_), sink);
+}
+
+// Called on the last bit of a BIC. If the previous block failed and this BIC
+// came one bit early or late, the block is likely to have slipped a bit.
+void Layer2::StartBlock(eBic bic, const L2BlockSink& sink) {
+  if (has_failed_block_) {
+    const std::uint64_t bic_offset = bit_position_ - failed_block_end_;
+    const int slip                 = (bic_offset == 14 ? -1 : bic_offset == 16 ? 1 : 0);
+    if (slip != 0 && block_.RecoverSlip(slip, bit_after_failed_block_)) {
+      num_slips_++;
+      sink(block_);
     }
+    has_failed_block_ = false;
   }
 
-  return blocks;
+  block_.Reset(bic, bit_position_ + 1);
+  in_sync_ = true;
+}
+
+void Layer2::PushBits(const SoftBit* bits, std::size_t num_bits, const L2BlockSink& sink,
+                      const std::uint64_t* sample_positions) {
+  chunk_sample_positions_ = sample_positions;
+  chunk_start_            = bit_position_;
+
+  for (std::size_t n_bit = 0; n_bit < num_bits; n_bit++) {
+    if (in_sync_)
+      PushSyncedBit(bits[n_bit], sink);
+    else
+      PushUnsyncedBit(bits[n_bit] > 0, sink);
+    bit_position_++;
+  }
+
+  chunk_sample_positions_ = nullptr;
+}
+
+// Sample number at which the current bit was received
+std::uint64_t Layer2::sample_position() const {
+  if (chunk_sample_positions_ != nullptr)
+    return chunk_sample_positions_[bit_position_ - chunk_start_];
+  return NominalSamplePosition(bit_position_);
+}
+
+// Out of sync, the buffer is searched with the correlator instead of shifting
+// every bit through the BIC register. Only windows that straddle the previous
+// buffer go through the register.
+void Layer2::PushPackedBits(const std::uint64_t* words, std::size_t num_bits,
+                            const L2BlockSink& sink) {
+  bic_candidates_.clear();
+  CorrelateBics(words, num_bits, 0, bic_candidates_);
+  auto candidate = bic_candidates_.cbegin();
+
+  const std::uint64_t buffer_start = bit_position_;
+
+  std::size_t n_bit = 0;
+  while (n_bit < num_bits) {
+    bit_position_ = buffer_start + n_bit;
+
+    if (in_sync_) {
+      PushSyncedBit(PackedBit(words, n_bit) ? kSoftBitMax : -kSoftBitMax, sink);
+      n_bit++;
+    } else if (n_bit < 15) {
+      PushUnsyncedBit(PackedBit(words, n_bit), sink);
+      n_bit++;
+    } else {
+      if (has_failed_block_ && bit_position_ == failed_block_end_)
+        bit_after_failed_block_ = PackedBit(words, n_bit);
+
+      while (candidate != bic_candidates_.cend() && candidate->block_start <= n_bit) ++candidate;
+
+      if (candidate == bic_candidates_.cend()) {
+        bic_register_ = PackedWindow(words, num_bits - 1);
+        n_bit         = num_bits;
+      } else {
+        n_bit         = candidate->block_start;
+        bic_register_ = kBics[candidate->bic];
+        bit_position_ = buffer_start + n_bit - 1;
+        StartBlock(candidate->bic, sink);
+      }
+    }
+  }
+
+  bit_position_ = buffer_start + num_bits;
+}
+
+void AppendL2BlockHex(std::string& out, const L2Block& block) {
+  out += static_cast<char>('0' + block.BicNum());
+  out += ' ';
+  out += std::to_string(block.start_position());
+  out += ' ';
+  out += std::to_string(block.sample_position());
+  out += block.is_corrected() ? " 1 " : " 0 ";
+  AppendHexString(out, block.information_bytes());
+  out += '\n';
+}
+
+namespace {
+
+int HexDigitValue(char chr) {
+  if (chr >= '0' && chr <= '9')
+    return chr - '0';
+  if (chr >= 'a' && chr <= 'f')
+    return chr - 'a' + 10;
+  if (chr >= 'A' && chr <= 'F')
+    return chr - 'A' + 10;
+  return -1;
+}
+
+// Parse a decimal number at the start of `line` and remove it. Returns false if
+// there are no digits.
+bool ConsumeDecimal(std::string_view& line, std::uint64_t& value) {
+  value              = 0;
+  std::size_t n_char = 0;
+  for (; n_char < line.size() && line[n_char] >= '0' && line[n_char] <= '9'; n_char++)
+    value = value * 10 + (line[n_char] - '0');
+  line.remove_prefix(n_char);
+  return n_char > 0;
+}
+
+}  // namespace
+
+bool ParseL2BlockHex(std::string_view line, L2Block& block) {
+  constexpr std::size_t kNumInfoBytes = 176 / 8;
+
+  if (line.size() < 2 || line[0] < '1' || line[0] > '4' || line[1] != ' ')
+    return false;
+  const auto bic = static_cast<eBic>(line[0] - '1');
+  line.remove_prefix(2);
+
+  std::uint64_t start_position = 0;
+  if (!ConsumeDecimal(line, start_position))
+    return false;
+
+  std::uint64_t sample_position = 0;
+  if (line.empty() || line[0] != ' ')
+    return false;
+  line.remove_prefix(1);
+  if (!ConsumeDecimal(line, sample_position))
+    return false;
+
+  if (line.size() != 3 + kNumInfoBytes * 3 - 1 || line[0] != ' ' || line[2] != ' ' ||
+      (line[1] != '0' && line[1] != '1'))
+    return false;
+  const bool is_corrected = (line[1] == '1');
+  line.remove_prefix(3);
+
+  std::array<std::uint8_t, kNumInfoBytes> info_bytes{};
+  for (std::size_t n_byte = 0; n_byte < kNumInfoBytes; n_byte++) {
+    const int high = HexDigitValue(line[3 * n_byte]);
+    const int low  = HexDigitValue(line[3 * n_byte + 1]);
+    if (high < 0 || low < 0 || (n_byte + 1 < kNumInfoBytes && line[3 * n_byte + 2] != ' '))
+      return false;
+    info_bytes[n_byte] = static_cast<std::uint8_t>((high << 4) | low);
+  }
+
+  block.Restore(bic, start_position, is_corrected, ByteView(info_bytes.data(), kNumInfoBytes));
+  block.set_sample_position(sample_position);
+  return true;
+}
+
+void PrintSlipCount(int num_slips) {
+  std::cerr << "layer2: " << num_slips << " bit slips recovered" << '\n';
+}
+
+// Consecutive blocks start 288 bits apart: a 16-bit BIC and the 272-bit block
+void BlockErrorRate::push(const L2Block& block) {
+  constexpr std::uint64_t kBlockPeriod = 16 + 272;
+
+  if (has_position_ && block.start_position() > next_position_) {
+    const std::uint64_t num_missing =
+        (block.start_position() - next_position_ + kBlockPeriod / 2) / kBlockPeriod;
+    for (std::uint64_t n = 0; n < std::min<std::uint64_t>(num_missing, is_error_.size()); n++)
+      push_result(true);
+  }
+  has_position_  = true;
+  next_position_ = block.start_position() + kBlockPeriod;
+
+  push_result(block.is_corrected());
+}
+
+void BlockErrorRate::push_result(bool is_error) {
+  if (num_results_ == is_error_.size())
+    num_errors_ -= is_error_[next_index_];
+  else
+    num_results_++;
+
+  is_error_[next_index_] = is_error;
+  num_errors_ += is_error;
+  next_index_ = (next_index_ + 1) % is_error_.size();
+}
+
+int BlockErrorRate::percent() const {
+  return num_results_ == 0 ? 0 : static_cast<int>(100 * num_errors_ / num_results_);
+}
+
+int Layer2::num_slips() const {
+  return num_slips_;
 }
 
 }  // namespace darc2json
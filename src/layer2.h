@@ -20,6 +20,9 @@
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "config.h"
@@ -31,45 +34,158 @@ namespace darc2json {
 
 enum eBic { BIC1, BIC2, BIC3, BIC4 };
 
-std::uint32_t field(const Bits& bits, int start_at, int length);
+// With up to 7 bits flipped by Chase decoding and one more by the syndrome
+// lookup we stay within the guaranteed correction capability of the code
+constexpr int kMaxChaseBits = 7;
 
-class Descrambler {
- public:
-  Descrambler();
-  int Descramble(int bit);
+// Remainder of the 82-bit L2 parity check; bit k of the array is the
+// coefficient of x^k
+using Syndrome = std::array<std::uint64_t, 2>;
 
- private:
-  std::array<int, 304> sequence_{};
-  int bit_counter_{};
+std::uint32_t field(const Bits& bits, int start_at, int length);
+
+// A possible block start found by the BIC correlator
+struct BicCandidate {
+  std::size_t block_start;  // Index of the first bit after the BIC
+  eBic bic;                 // Closest matching BIC
+  int distance;             // Number of bit errors in the BIC
 };
 
+// Sample number, at the target sample rate, at which the bit at
+// `bit_position` would be received if the bit clock ran at exactly its nominal
+// rate. Stands in for the real sample position with inputs that have no
+// samples, such as bit dumps.
+std::uint64_t NominalSamplePosition(std::uint64_t bit_position);
+
+// Find every bit offset in a packed buffer (MSB-first 64-bit words) where one of
+// the four BICs appears with at most max_distance bit errors. Candidates are
+// appended to `candidates` in stream order.
+void CorrelateBics(const std::uint64_t* words, std::size_t num_bits, int max_distance,
+                   std::vector<BicCandidate>& candidates);
+
 class L2Block {
  public:
-  L2Block(eBic _bic);
+  explicit L2Block(eBic _bic, int num_chase_bits = 0);
   ~L2Block() = default;
-  void PushBit(int bit);
+  void Reset(eBic bic, std::uint64_t start_position = 0);
+  void Restore(eBic bic, std::uint64_t start_position, bool is_corrected,
+               ByteView information_bytes);
+  void PushBit(SoftBit bit);
   bool complete() const;
   int BicNum() const;
   bool crc_ok();
-  Bits information_bits() const;
+  bool RecoverSlip(int slip, int next_bit);
+  ByteView information_bytes() const;
+  std::uint64_t start_position() const;
+  std::uint64_t sample_position() const;
+  void set_sample_position(std::uint64_t sample_position);
+  bool is_corrected() const;
+
+  // 272 bits, padded to a whole number of 64-bit words
+  static constexpr std::size_t kNumBytes = 40;
 
  private:
+  struct WeakBit {
+    std::uint16_t position;
+    std::uint8_t reliability;
+  };
+
+  void Descramble();
+  void TrackWeakBit(std::size_t position, int reliability);
+  bool ChaseDecode(Syndrome syndrome);
+  void FlipBit(std::size_t position);
+  bool CorrectSyndrome(const Syndrome& syndrome);
+  Syndrome syndrome() const;
+  int bit(std::size_t position) const;
+
   eBic bic_;
-  Bits bits_;
+  // Bit n of the block is bit (n % 8) of byte (n / 8)
+  std::array<std::uint8_t, kNumBytes> bytes_{};
   std::size_t bit_counter_{};
-  Descrambler descrambler_{};
+  std::uint64_t start_position_{};
+  std::uint64_t sample_position_{};
+  bool is_corrected_{};
+
+  // The least reliable soft bits received so far, candidates for Chase decoding
+  std::array<WeakBit, kMaxChaseBits> weak_bits_{};
+  int num_chase_bits_{};
+  int num_weak_bits_{};
+  int strongest_weak_bit_{};
+};
+
+// Append a block as one line of text: BIC number, stream position of the first
+// bit after the BIC, sample position of the last bit, 1 if bit errors were
+// corrected or 0 if not, and the information bytes in hex. For example:
+// 3 14688 213157 0 2a 80 06 ...
+void AppendL2BlockHex(std::string& out, const L2Block& block);
+
+// Parse a line written by AppendL2BlockHex, without the newline. Returns false
+// if the line is malformed.
+bool ParseL2BlockHex(std::string_view line, L2Block& block);
+
+// Report Layer2::num_slips() on stderr, which --bler does at exit
+void PrintSlipCount(int num_slips);
+
+// Percentage of blocks that were missing or needed error correction, averaged
+// over the last kNumBlerAverageBlocks. Missing blocks are found by gaps in the
+// stream positions of the blocks that did arrive.
+class BlockErrorRate {
+ public:
+  BlockErrorRate() = default;
+  void push(const L2Block& block);
+  int percent() const;
+
+ private:
+  void push_result(bool is_error);
+
+  std::array<bool, kNumBlerAverageBlocks> is_error_{};
+  std::size_t next_index_{};
+  std::size_t num_results_{};
+  int num_errors_{};
+  bool has_position_{};
+  std::uint64_t next_position_{};
 };
 
+// Receives each complete, CRC-valid block. The block is only valid for the
+// duration of the call.
+using L2BlockSink = std::function<void(const L2Block&)>;
+
 class Layer2 {
  public:
-  Layer2();
+  explicit Layer2(const Options& options);
   ~Layer2() = default;
-  std::vector<L2Block> PushBit(int bit);
+  // `sample_positions`, if given, has the sample number at which each bit was
+  // received
+  void PushBits(const SoftBit* bits, std::size_t num_bits, const L2BlockSink& sink,
+                const std::uint64_t* sample_positions = nullptr);
+  void PushPackedBits(const std::uint64_t* words, std::size_t num_bits, const L2BlockSink& sink);
+  // Number of blocks recovered from a slipped bit
+  int num_slips() const;
 
  private:
+  void PushUnsyncedBit(int bit, const L2BlockSink& sink);
+  void PushSyncedBit(SoftBit bit, const L2BlockSink& sink);
+  void StartBlock(eBic bic, const L2BlockSink& sink);
+  std::uint64_t sample_position() const;
+
   std::uint16_t bic_register_;
+  std::vector<BicCandidate> bic_candidates_;
   L2Block block_;
   bool in_sync_{};
+
+  // Index of the bit being processed, counted from the start of the stream
+  std::uint64_t bit_position_{};
+  // Sample positions of the bits passed to PushBits(), if any, starting at
+  // bit_position chunk_start_
+  const std::uint64_t* chunk_sample_positions_{};
+  std::uint64_t chunk_start_{};
+
+  // A block that failed the CRC is kept until the next BIC shows whether a bit
+  // slipped inside it
+  bool has_failed_block_{};
+  std::uint64_t failed_block_end_{};
+  int bit_after_failed_block_{};
+  int num_slips_{};
 };
 
 }  // namespace darc2json
@@ -16,26 +16,28 @@
  */
 #include "src/layer3_4.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <ctime>
 #include <iomanip>
-#include <iostream>
 #include <sstream>
+#include <string>
+#include <string_view>
 
-#include <nlohmann/json.hpp>
-
+#include "src/header_views.h"
 #include "src/layer2.h"
+#include "src/output.h"
 #include "src/util.h"
 
 namespace darc2json {
 
-const Bits kL3ShortMessageHeaderCRC = poly_coeffs_to_bits({6, 4, 3, 0});
-const Bits kL4ShortMessageHeaderCRC = poly_coeffs_to_bits({8, 5, 4, 3, 0});
-const Bits kL3LongMessageHeaderCRC  = poly_coeffs_to_bits({6, 4, 3, 0});
-const Bits kL4LongMessageHeaderCRC  = poly_coeffs_to_bits({6, 4, 3, 0});
+constexpr CrcPolynomial kL3ShortMessageHeaderCRC = CrcPolynomialFromCoeffs({6, 4, 3, 0});
+constexpr CrcPolynomial kL4ShortMessageHeaderCRC = CrcPolynomialFromCoeffs({8, 5, 4, 3, 0});
+constexpr CrcPolynomial kL3LongMessageHeaderCRC  = CrcPolynomialFromCoeffs({6, 4, 3, 0});
+constexpr CrcPolynomial kL4LongMessageHeaderCRC  = CrcPolynomialFromCoeffs({6, 4, 3, 0});
 
 std::string TimeString(int hours, int minutes, int seconds) {
   std::stringstream ss;
@@ -43,30 +45,60 @@ std::string TimeString(int hours, int minutes, int seconds) {
   return ss.str();
 }
 
-std::string TimePointToString(const std::chrono::time_point<std::chrono::system_clock>& timepoint,
-                              const std::string& format) {
-  std::time_t t = std::chrono::system_clock::to_time_t(timepoint);
-  std::tm tm    = *std::localtime(&t);
+DecodeFilter::DecodeFilter(const Options& options)
+    : silchs_(options.silch_filter),
+      data_types_(options.data_type_filter),
+      transport_ids_(options.transport_id_filter) {}
 
-  std::string result;
-  char buffer[64];
-  if (strftime(buffer, sizeof(buffer), format.c_str(), &tm) > 0) {
-    result = std::string(buffer);
-  } else {
-    result = "(format error)";
-  }
+bool DecodeFilter::Contains(const std::vector<int>& list, int value) {
+  return std::find(list.begin(), list.end(), value) != list.end();
+}
 
-  return result;
+bool DecodeFilter::accepts_channel(int silch) const {
+  return silchs_.empty() || Contains(silchs_, silch);
 }
 
-SechBlock::SechBlock(const Bits& info_bits)
-    : is_last_fragment_(field(info_bits, 5, 1)),
-      data_update_(field(info_bits, 6, 2)),
-      country_id_(field(info_bits, 8, 4)),
-      data_type_(field(info_bits, 12, 4)),
-      network_id_(field(info_bits, 16, 4)),
-      block_num_(field(info_bits, 20, 4)),
-      data_(info_bits.begin() + 24, info_bits.begin() + 24 + 19 * 8) {}
+bool DecodeFilter::accepts_service_type(int data_type) const {
+  return transport_ids_.empty() && (data_types_.empty() || Contains(data_types_, data_type));
+}
+
+bool DecodeFilter::accepts_block_app() const {
+  return data_types_.empty() && transport_ids_.empty();
+}
+
+bool DecodeFilter::accepts_frame(ByteView frame_start) {
+  // Up to the end of the transport id in the L5 header
+  constexpr std::size_t kMinFrameStartBytes = 6;
+
+  if (data_types_.empty() && transport_ids_.empty())
+    return true;
+  if (frame_start.size() < kMinFrameStartBytes)
+    return false;
+
+  const L4HeaderView header(frame_start);
+  if (!header.is_first())
+    return is_channel_accepted_[header.channel_id()];
+
+  // The type as the reassembled message will have it, marked as both first
+  // and last fragment
+  const int type   = header.type() | 0x0C;
+  bool is_accepted = data_types_.empty() || Contains(data_types_, type);
+  if (!transport_ids_.empty())
+    is_accepted = is_accepted && type == kL4TypeGroupData &&
+                  Contains(transport_ids_, L5HeaderView(frame_start).transport_id());
+
+  is_channel_accepted_[header.channel_id()] = is_accepted;
+  return is_accepted;
+}
+
+SechBlock::SechBlock(ByteView info_bytes)
+    : is_last_fragment_(L3HeaderView(info_bytes).is_last_fragment()),
+      data_update_(L3HeaderView(info_bytes).data_update()),
+      country_id_(L3HeaderView(info_bytes).country_id()),
+      data_type_(L3HeaderView(info_bytes).data_type()),
+      network_id_(L3HeaderView(info_bytes).network_id()),
+      block_num_(L3HeaderView(info_bytes).block_num()),
+      data_(info_bytes.subview(3, 19)) {}
 
 bool SechBlock::is_last_fragment() const {
   return is_last_fragment_;
@@ -76,10 +108,8 @@ int SechBlock::block_num() const {
   return block_num_;
 }
 
-bool SechBlock::follows_in_sequence(const SechBlock& previous) const {
-  return data_update_ == previous.data_update_ && country_id_ == previous.country_id_ &&
-         data_type_ == previous.data_type_ && network_id_ == previous.network_id_ &&
-         block_num_ == previous.block_num_ + 1;
+int SechBlock::data_update() const {
+  return data_update_;
 }
 
 int SechBlock::country_id() const {
@@ -94,25 +124,43 @@ int SechBlock::network_id() const {
   return network_id_;
 }
 
-Bits SechBlock::data_bits() const {
+ByteView SechBlock::data_bytes() const {
   return data_;
 }
 
+void ServiceMessage::clear() {
+  num_blocks_  = 0;
+  is_complete_ = false;
+}
+
+bool ServiceMessage::follows_in_sequence(const SechBlock& block) const {
+  return block.data_update() == data_update_ && block.country_id() == country_id_ &&
+         block.data_type() == data_type_ && block.network_id() == network_id_ &&
+         block.block_num() == num_blocks_;
+}
+
+// Header fields are kept from the first block, and the payload of each block
+// is appended to a fixed buffer in place
 void ServiceMessage::push_block(const SechBlock& block) {
-  if (block.block_num() == 0) {
-    blocks_.clear();
-    is_complete_ = false;
-  }
+  if (block.block_num() == 0)
+    clear();
+
+  if (block.block_num() == num_blocks_ && (block.block_num() == 0 || follows_in_sequence(block))) {
+    if (block.block_num() == 0) {
+      data_update_ = block.data_update();
+      country_id_  = block.country_id();
+      data_type_   = block.data_type();
+      network_id_  = block.network_id();
+    }
 
-  if (block.block_num() == static_cast<int>(blocks_.size()) &&
-      (block.block_num() == 0 || block.follows_in_sequence(blocks_.back()))) {
-    blocks_.push_back(block);
+    const ByteView block_data = block.data_bytes();
+    std::copy(block_data.begin(), block_data.end(), data_.begin() + num_blocks_ * kBytesPerBlock);
+    num_blocks_++;
 
     if (block.is_last_fragment())
       is_complete_ = true;
   } else {
-    blocks_.clear();
-    is_complete_ = false;
+    clear();
   }
 }
 
@@ -120,60 +168,67 @@ bool ServiceMessage::is_complete() const {
   return is_complete_;
 }
 
-Bits ServiceMessage::data_bits() const {
-  Bits result;
-  for (SechBlock block : blocks_) {
-    for (int b : block.data_bits()) result.push_back(b);
-  }
+ByteView ServiceMessage::data_bytes() const {
+  return ByteView(data_.data(), num_blocks_ * kBytesPerBlock);
+}
 
-  return result;
+// With ignore_tdt_clock, the time of day and date fields of a TDT are left out
+// so that clock ticks alone don't count as a change. The local time offset and
+// accuracy flag still do.
+std::uint64_t ServiceMessage::content_hash(bool ignore_tdt_clock) const {
+  const ByteView data_bytes = this->data_bytes();
+  if (!ignore_tdt_clock || data_type() != kTypeTDT)
+    return HashBytes(data_bytes);
+
+  constexpr std::size_t kNumHeaderBytes = 10;
+  std::array<std::uint8_t, kNumHeaderBytes> header{};
+  std::copy(data_bytes.begin(), data_bytes.begin() + kNumHeaderBytes, header.begin());
+  TdtView::Hour::Clear(header.data());
+  TdtView::Minute::Clear(header.data());
+  TdtView::Seconds::Clear(header.data());
+  TdtView::ModifiedJulianDate::Clear(header.data());
+
+  return HashBytes(data_bytes.subview(kNumHeaderBytes, data_bytes.size() - kNumHeaderBytes),
+                   HashBytes(ByteView(header.data(), header.size())));
 }
 
 int ServiceMessage::country_id() const {
-  return blocks_.empty() ? 0 : blocks_[0].country_id();
+  return num_blocks_ == 0 ? 0 : country_id_;
 }
 
 int ServiceMessage::network_id() const {
-  return blocks_.empty() ? 0 : blocks_[0].network_id();
+  return num_blocks_ == 0 ? 0 : network_id_;
 }
 
 int ServiceMessage::data_type() const {
-  return blocks_.empty() ? 0 : blocks_[0].data_type();
+  return num_blocks_ == 0 ? 0 : data_type_;
 }
 
-nlohmann::ordered_json ServiceMessage::to_json() const {
-  nlohmann::ordered_json json;
-
+void ServiceMessage::write(RecordWriter& record) const {
   if (!is_complete())
-    return json;
-
-  const std::vector<std::string> sech_types({"COT", "AFT", "SAFT", "TDPNT", "SNT", "TDT", "SCOT"});
-
-  const Bits data = data_bits();
+    return;
 
-  const std::vector<std::uint8_t> data_bytes = bit_vector_to_reversed_bytes(data);
+  const ByteView data_bytes = this->data_bytes();
 
-  json["country_code"] = country_id();
-  json["network_id"]   = network_id();
+  record.add("country_code", country_id());
+  record.add("network_id", network_id());
 
-  json["service_message"]["type"] =
-      (data_type() < static_cast<int>(sech_types.size()) ? sech_types.at(data_type()) : "err");
+  record.begin_object("service_message");
+  record.add("type", (data_type() < static_cast<int>(kSechTypeNames.size())
+                          ? kSechTypeNames[data_type()]
+                          : "err"));
 
-  const int ecc                     = field(data, 0, 8);
-  const int tseid                   = field(data, 8, 7);
+  const ServiceHeaderView header(data_bytes);
   // int message_len = field(data, 15, 9);
-  json["service_message"]["tse_id"] = tseid;
+  record.add("tse_id", header.tse_id());
 
-  json["service_message"]["country"] = CountryString(country_id(), ecc);
+  record.add("country", CountryString(country_id(), header.ecc()));
 
   if (data_type() == kTypeTDT) {
-    const Bits time_bits(data.begin() + 3 * 8, data.begin() + 7 * 8 + 1);
-    const Bits date_bits(data.begin() + 7 * 8, data.begin() + 10 * 8 + 1);
-
-    int modified_julian_date = bfield(data_bytes, 7, 6, 17);
+    const TdtView tdt(data_bytes);
+    int modified_julian_date = tdt.modified_julian_date();
 
-    const double local_offset =
-        (bfield(data_bytes, 5, 5, 1) ? -1 : 1) * bfield(data_bytes, 5, 4, 5) / 2.0;
+    const double local_offset = (tdt.local_offset_negative() ? -1 : 1) * tdt.local_offset() / 2.0;
     modified_julian_date += local_offset / 24.0;
 
     int year  = (modified_julian_date - 15078.2) / 365.25;
@@ -189,11 +244,11 @@ nlohmann::ordered_json ServiceMessage::to_json() const {
 
     const int local_offset_min = (local_offset - std::trunc(local_offset)) * 60;
 
-    const bool eta    = bfield(data_bytes, 3, 7, 1);
+    const bool eta    = tdt.time_accurate();
     // const std::uint8_t taf = data_bytes[6];
-    const int hour    = bfield(data_bytes, 3, 6, 5);
-    const int minute  = bfield(data_bytes, 3, 1, 6);
-    const int seconds = bfield(data_bytes, 4, 3, 6);
+    const int hour    = tdt.hour();
+    const int minute  = tdt.minute();
+    const int seconds = tdt.seconds();
 
     const bool is_date_valid =
         (month >= 1 && month <= 12 && day >= 1 && day <= 31 && hour >= 0 && hour <= 23 &&
@@ -210,39 +265,28 @@ nlohmann::ordered_json ServiceMessage::to_json() const {
                       month, day, hour, minute, seconds, local_offset > 0 ? "+" : "-",
                       local_offset_hour, abs(local_offset_min));
       }
-      json["service_message"]["clock_time"] = std::string(buffer);
-    }
-
-    size_t name_len = bfield(data_bytes, 9, 5, 4);
-    std::string name;
-    if (data_bytes.size() >= 10 + name_len - 1) {
-      for (size_t i = 0; i < name_len; i++) {
-        name += (char)(data_bytes[10 + i]);
-      }
+      record.add("clock_time", buffer);
     }
-    json["service_message"]["network_name"]  = name;
-    json["service_message"]["time_accurate"] = eta;
 
-    bool has_position = field(date_bits, 2 * 9 + 6, 1);
+    const std::size_t name_len = tdt.name_length();
+    std::string_view name;
+    if (data_bytes.size() >= 10 + name_len)
+      name = std::string_view(reinterpret_cast<const char*>(data_bytes.data()) + 10, name_len);
+    record.add("network_name", name);
+    record.add("time_accurate", eta);
 
-    if (has_position) {
+    if (tdt.has_position()) {
     }
   }
-
-  return json;
+  record.end_object();
 }
 
-LongBlock::LongBlock(const Bits& info_bits)
-    : is_last_fragment_(field(info_bits, 5, 1)),
-      sequence_counter_(field(info_bits, 6, 4)),
-      bytes_(bit_vector_to_reversed_bytes(Bits(info_bits.begin() + 16, info_bits.end()))) {
-  // bool di = field(info_bits, 4, 1);
-  l3_header_crc_ok_ = check_crc(info_bits, kL3LongMessageHeaderCRC, 16);
-
-  /*  printf(" LF[%s] SC:%02d L3_CRC_OK[%s]\n",
-        is_last_fragment_ ? "x" : " ",
-        sequence_counter_,
-        l3_header_crc_ok_ ? "x" : " ");*/
+LongBlock::LongBlock(ByteView info_bytes)
+    : is_last_fragment_(L3HeaderView(info_bytes).is_last_fragment()),
+      sequence_counter_(L3HeaderView(info_bytes).sequence_counter()),
+      l3_header_crc_ok_(check_crc(info_bytes, BitOrder::LsbFirst, kL3LongMessageHeaderCRC, 16)),
+      bytes_(info_bytes.subview(2, 20)) {
+  // bool di = packed_field(info_bytes, 4, 1);
 }
 
 bool LongBlock::is_last_fragment() const {
@@ -253,30 +297,55 @@ bool LongBlock::header_crc_ok() const {
   return l3_header_crc_ok_;
 }
 
-bool LongBlock::follows_in_sequence(const LongBlock& previous) const {
-  return sequence_counter_ == ((previous.sequence_counter_ + 1) % 16) && header_crc_ok() &&
-         previous.header_crc_ok() && !previous.is_last_fragment();
+int LongBlock::sequence_counter() const {
+  return sequence_counter_;
 }
 
-Bits LongBlock::data() const {
+ByteView LongBlock::data() const {
   return bytes_;
 }
 
-LongMessage::LongMessage() : is_complete_(false), l4_header_crc_ok_(false) {}
+LongMessage::LongMessage(DecodeFilter* filter)
+    : is_complete_(false), l4_header_crc_ok_(false), filter_(filter) {}
+
+void LongMessage::clear() {
+  num_bytes_        = 0;
+  num_blocks_       = 0;
+  l4_header_crc_ok_ = false;
+  is_complete_      = false;
+  is_rejected_      = false;
+}
+
+bool LongMessage::follows_in_sequence(const LongBlock& block) const {
+  return block.sequence_counter() == ((last_sequence_counter_ + 1) % 16) &&
+         block.header_crc_ok() && !last_was_final_;
+}
 
+// Block payloads are appended to a fixed buffer; a message that would
+// overflow it is dropped
 void LongMessage::push_block(const LongBlock& block) {
-  if (blocks_.size() > 0 && !block.follows_in_sequence(blocks_.back())) {
-    blocks_.clear();
-    bytes_.clear();
-    l4_header_crc_ok_ = false;
-    is_complete_      = false;
-  }
+  if (num_blocks_ > 0 && !follows_in_sequence(block))
+    clear();
 
   if (block.header_crc_ok()) {
-    blocks_.push_back(block);
-    for (const std::uint8_t byte : block.data()) bytes_.push_back(byte);
+    const ByteView block_data = block.data();
+    if (num_bytes_ + block_data.size() > bytes_.size()) {
+      clear();
+      return;
+    }
 
-    if (block.is_last_fragment())
+    if (num_blocks_ == 0 && filter_ != nullptr)
+      is_rejected_ = !filter_->accepts_frame(block_data);
+
+    if (!is_rejected_) {
+      std::copy(block_data.begin(), block_data.end(), bytes_.begin() + num_bytes_);
+      num_bytes_ += block_data.size();
+    }
+    num_blocks_++;
+    last_sequence_counter_ = block.sequence_counter();
+    last_was_final_        = block.is_last_fragment();
+
+    if (block.is_last_fragment() && !is_rejected_)
       parse_l4_header();
   }
 }
@@ -284,214 +353,550 @@ void LongMessage::push_block(const LongBlock& block) {
 void LongMessage::parse_l4_header() {
   l4_header_crc_ok_ = false;
 
-  if (blocks_.empty())
+  if (num_blocks_ == 0)
     return;
 
-  Bits header_bits = reversed_bytes_to_bit_vector(bytes_);
-
-  // const int ci   = field(header_bits, 2, 2);
-  const int fl   = field(header_bits, 4, 2);
-  const bool ext = field(header_bits, 6, 1);
-  const bool caf = field(header_bits, 17, 1);
-  // size_t dlen = field(header_bits, 18 + ext * 8, 8);
+  const ByteView header_bytes = bytes();
+  const L4HeaderView header(header_bytes);
 
-  is_first_ = fl & 1;
-  is_last_  = fl & 2;
+  is_first_      = header.is_first();
+  is_last_       = header.is_last();
+  channel_id_    = header.channel_id();
+  header_length_ = header.length();
+  data_length_   = header.data_length();
 
-  if (caf)
+  if (header.caf())
     return;
 
-  header_bits.resize((4 + ext) * 8);
-
-  const bool crc_ok   = check_crc(header_bits, kL4LongMessageHeaderCRC, header_bits.size());
-  const bool complete = true;  //(bytes_.size() >= dlen);
-
-  /*printf("L4: CI:%d ext:[%s] caf:[%s] dlen:%3ld "
-         "(rx: %3ld) L4_CRC_OK[%s]",
-      ci,
-      ext ? "x" : " ",
-      caf ? "x" : " ",
-      dlen,
-      bytes_.size(),
-      crc_ok ? "x" : " ");
-  if (complete)
-    printf(" COMPLETE");
+  const bool crc_ok =
+      check_crc(header_bytes, BitOrder::MsbFirst, kL4LongMessageHeaderCRC, header_length_ * 8);
+  const bool complete = true;  //(num_bytes_ >= header_length_ + data_length_);
 
-  printf("\n");*/
   if (crc_ok && complete) {
     is_complete_ = true;
-    // bytes_.resize(dlen);
-    /*printf("data: ");
-    for (uint8_t c : bytes_)
-      printf("%02x ", c);
-    for (uint8_t c : bytes_)
-      printf("%c", c);*/
   }
-  // printf("\n\n");
+}
+
+// Replace the contents with a whole L4 frame, e.g. one completed by the
+// carousel cache
+void LongMessage::assign(ByteView frame) {
+  clear();
+  if (frame.empty() || frame.size() > bytes_.size())
+    return;
+
+  std::copy(frame.begin(), frame.end(), bytes_.begin());
+  num_bytes_      = frame.size();
+  num_blocks_     = 1;
+  last_was_final_ = true;
+  parse_l4_header();
 }
 
 bool LongMessage::is_complete() const {
   return is_complete_;
 }
 
-nlohmann::ordered_json LongMessage::to_json() const {
-  nlohmann::ordered_json json;
+bool LongMessage::is_first() const {
+  return is_first_;
+}
+
+bool LongMessage::is_last() const {
+  return is_last_;
+}
+
+int LongMessage::channel_id() const {
+  return channel_id_;
+}
+
+// In bytes
+std::size_t LongMessage::header_length() const {
+  return header_length_;
+}
+
+// In bytes, not counting the header or the padding after the data
+std::size_t LongMessage::data_length() const {
+  return data_length_;
+}
+
+ByteView LongMessage::bytes() const {
+  return ByteView(bytes_.data(), num_bytes_);
+}
+
+void LongMessage::write(RecordWriter& record) const {
+  WriteL4Message(record, bytes(), is_first_, is_last_);
+}
+
+// A first fragment starts a new message on its channel, replacing any
+// unfinished one there. The following fragments contribute their data after
+// the L4 header. The padding that fills up a frame's last block is left out.
+bool FragmentReassembler::push_frame(const LongMessage& frame,
+                                     std::chrono::system_clock::time_point rx_time) {
+  expire(rx_time);
+
+  const ByteView frame_bytes = frame.bytes();
+  if (frame_bytes.size() < frame.header_length() + frame.data_length())
+    return false;
+
+  const int channel_id    = frame.channel_id();
+  PartialMessage& partial = partial_messages_[channel_id];
+
+  ByteView fragment;
+  if (frame.is_first()) {
+    drop(channel_id);
+    fragment = frame_bytes.subview(0, frame.header_length() + frame.data_length());
+  } else if (partial.bytes.empty()) {
+    // The start of this message was missed
+    return false;
+  } else {
+    fragment = frame_bytes.subview(frame.header_length(), frame.data_length());
+  }
+
+  if (partial.bytes.size() + fragment.size() > kMaxMessageBytes) {
+    drop(channel_id);
+    return false;
+  }
+
+  make_room(fragment.size(), channel_id);
+  partial.bytes.insert(partial.bytes.end(), fragment.begin(), fragment.end());
+  partial.last_update = rx_time;
+  total_bytes_ += fragment.size();
+
+  if (!frame.is_last())
+    return false;
 
-  json["long_message"]["first"] = is_first_;
-  json["long_message"]["last"]  = is_last_;
+  message_.swap(partial.bytes);
+  drop(channel_id);
 
-  if (is_first_ && is_last_) {
-    const bool has_crc              = (bytes_[0] >> 6) & 1;
-    const int type                  = (bytes_[0]) & 0xf;
-    json["long_message"]["has_crc"] = has_crc;
-    json["long_message"]["type"]    = type;
-    // printf("lm:%s\n",BytesToHexString(bytes_).c_str());
-    if (type == 12) {
-      const int transport_id               = bfield(bytes_, 3, 0, 16);
-      const int len                        = bfield(bytes_, 2, 7, 4);  // ibytes_[2] & 0xf;
-      json["long_message"]["transport_id"] = transport_id;
-      json["long_message"]["hlen"]         = len;
+  // Mark as both first and last fragment so that it decodes like an
+  // unfragmented message
+  message_[0] |= 0x0C;
 
-      std::size_t nbyte = 5;
-      while (nbyte < bytes_.size() - 1) {
-        // std::uint8_t tag = bytes_[nbyte];
+  return true;
+}
+
+ByteView FragmentReassembler::message() const {
+  return message_;
+}
+
+void FragmentReassembler::drop(int channel_id) {
+  PartialMessage& partial = partial_messages_[channel_id];
+  total_bytes_ -= partial.bytes.size();
+  partial.bytes.clear();
+}
+
+void FragmentReassembler::expire(std::chrono::system_clock::time_point now) {
+  for (int channel_id = 0; channel_id < kNumChannels; channel_id++) {
+    const PartialMessage& partial = partial_messages_[channel_id];
+    if (!partial.bytes.empty() && now - partial.last_update > kMaxAge)
+      drop(channel_id);
+  }
+}
+
+// Evict the least recently updated partial messages on other channels until
+// num_bytes more fit in the total budget
+void FragmentReassembler::make_room(std::size_t num_bytes, int keep_channel_id) {
+  while (total_bytes_ + num_bytes > kMaxTotalBytes) {
+    int oldest = -1;
+    for (int channel_id = 0; channel_id < kNumChannels; channel_id++) {
+      if (channel_id == keep_channel_id || partial_messages_[channel_id].bytes.empty())
+        continue;
+      if (oldest < 0 || partial_messages_[channel_id].last_update <
+                            partial_messages_[oldest].last_update)
+        oldest = channel_id;
+    }
+    if (oldest < 0)
+      break;
+    drop(oldest);
+  }
+}
+
+// True if the bytes begin with the L4 header of a message's first fragment,
+// with a valid CRC. The CRC is only 6 bits, so about one in 64 blocks from the
+// middle of a frame passes it too.
+bool LooksLikeFirstFragment(ByteView bytes) {
+  const L4HeaderView header(bytes);
+  return bytes.size() >= header.length() && header.is_first() &&
+         check_crc(bytes, BitOrder::MsbFirst, kL4LongMessageHeaderCRC, header.length() * 8);
+}
+
+// A transmission starts with the block after a last block. Only if blocks were
+// lost, so that the last block may have been among them, is a block that looks
+// like the start of a message taken as a frame start. Positions within the
+// frame are counted from the sequence counter, so up to 15 consecutive blocks
+// may be lost.
+CarouselCache::CarouselCache(DecodeFilter* filter) : filter_(filter) {}
+
+bool CarouselCache::push_block(const LongBlock& block) {
+  if (!block.header_crc_ok())
+    return false;
+
+  const int sequence_counter = block.sequence_counter();
+  const int gap = previous_sequence_counter_ < 0
+                      ? 0
+                      : (sequence_counter - previous_sequence_counter_ + 16) % 16;
+  const bool starts_after_last = previous_was_last_ && gap == 1;
+  const bool may_follow_lost_blocks = previous_sequence_counter_ < 0 || gap > 1;
+
+  previous_sequence_counter_ = sequence_counter;
+  previous_was_last_         = block.is_last_fragment();
+
+  bool is_complete = false;
+
+  if (in_frame_ && is_rejected_ && !starts_after_last) {
+    // Only followed to know where the next frame starts
+    position_ += gap;
+    if (gap == 0 || position_ >= kMaxNumBlocks || block.is_last_fragment())
+      in_frame_ = false;
+  } else if (in_frame_ && !starts_after_last) {
+    position_ += gap;
+    const auto cached = frames_.find(frame_id_);
+    if (gap == 0 || cached == frames_.end() || position_ >= kMaxNumBlocks ||
+        (cached->second.num_blocks > 0 && position_ >= cached->second.num_blocks)) {
+      in_frame_ = false;
+    } else {
+      is_complete = place_block(cached->second, position_, block);
+    }
+  }
+
+  if (!in_frame_ &&
+      (starts_after_last || (may_follow_lost_blocks && LooksLikeFirstFragment(block.data())))) {
+    frame_id_    = HashBytes(block.data());
+    in_frame_    = !block.is_last_fragment();
+    position_    = 0;
+    is_rejected_ = (filter_ != nullptr && !filter_->accepts_frame(block.data()));
+    if (!is_rejected_) {
+      auto cached = frames_.find(frame_id_);
+      if (cached == frames_.end()) {
+        cached = frames_.emplace(frame_id_, CachedFrame()).first;
+        total_bytes_ += MemoryUsage(cached->second);
+      }
+      is_complete = place_block(cached->second, position_, block);
+    }
+  }
+
+  while (total_bytes_ > kMaxTotalBytes && frames_.size() > 1) evict_least_recently_used();
+
+  return is_complete;
+}
+
+ByteView CarouselCache::frame() const {
+  return completed_frame_;
+}
+
+// Returns true if the frame became complete with content that wasn't emitted
+// before
+bool CarouselCache::place_block(CachedFrame& frame, int position, const LongBlock& block) {
+  frame.last_use = ++use_counter_;
+  if (block.is_last_fragment())
+    in_frame_ = false;
+
+  const std::size_t num_blocks = position + 1;
+  if (frame.received.size() < num_blocks) {
+    total_bytes_ -= MemoryUsage(frame);
+    frame.bytes.resize(num_blocks * kBytesPerBlock);
+    frame.received.resize(num_blocks);
+    total_bytes_ += MemoryUsage(frame);
+  }
+
+  const ByteView data = block.data();
+  const auto offset   = frame.bytes.begin() + position * kBytesPerBlock;
+
+  if (frame.received[position]) {
+    if (std::equal(data.begin(), data.end(), offset))
+      return false;
+
+    // The frame has changed since it was last received; start over
+    std::fill(frame.received.begin(), frame.received.end(), false);
+    frame.num_blocks = 0;
+  }
+
+  std::copy(data.begin(), data.end(), offset);
+  frame.received[position] = true;
+  if (block.is_last_fragment())
+    frame.num_blocks = num_blocks;
+
+  if (frame.num_blocks == 0 || frame.received.size() < static_cast<std::size_t>(frame.num_blocks) ||
+      !std::all_of(frame.received.begin(), frame.received.begin() + frame.num_blocks,
+                   [](bool received) { return received; }))
+    return false;
+
+  const ByteView bytes(frame.bytes.data(), frame.num_blocks * kBytesPerBlock);
+  const std::uint64_t hash = HashBytes(bytes);
+  if (frame.emitted && hash == frame.emitted_hash)
+    return false;
+
+  frame.emitted      = true;
+  frame.emitted_hash = hash;
+  completed_frame_   = bytes;
+  return true;
+}
+
+// The frame currently being received is never evicted
+void CarouselCache::evict_least_recently_used() {
+  auto oldest = frames_.end();
+  for (auto it = frames_.begin(); it != frames_.end(); ++it) {
+    if (it->first != frame_id_ &&
+        (oldest == frames_.end() || it->second.last_use < oldest->second.last_use))
+      oldest = it;
+  }
+  if (oldest == frames_.end())
+    return;
+
+  total_bytes_ -= MemoryUsage(oldest->second);
+  frames_.erase(oldest);
+}
+
+// Counts the flags and the map entry too, so that many small frames are
+// bounded as well as a few large ones
+std::size_t CarouselCache::MemoryUsage(const CachedFrame& frame) {
+  return sizeof(std::pair<const std::uint64_t, CachedFrame>) + frame.bytes.capacity() +
+         frame.received.capacity() / 8;
+}
+
+void WriteL4Message(RecordWriter& record, ByteView bytes, bool is_first, bool is_last) {
+  record.begin_object("long_message");
+  record.add("first", is_first);
+  record.add("last", is_last);
+
+  if (is_first && is_last) {
+    const L4HeaderView header(bytes);
+    record.add("has_crc", header.has_crc());
+    record.add("type", header.type());
+    // printf("lm:%s\n",BytesToHexString(bytes).c_str());
+    if (header.type() == kL4TypeGroupData) {
+      const L5HeaderView l5_header(bytes);
+      record.add("transport_id", l5_header.transport_id());
+      record.add("hlen", l5_header.header_length());
+
+      bool has_group_data = false;
+      std::size_t nbyte   = 5;
+      while (nbyte < bytes.size() - 1) {
+        // std::uint8_t tag = bytes[nbyte];
         nbyte++;
-        const std::uint8_t len = bytes_[nbyte];
+        const std::uint8_t len = bytes[nbyte];
         nbyte++;
         if (len > 0) {
-          std::vector<uint8_t> tlv_bytes;
-          for (int l = 0; l < len && nbyte < bytes_.size(); l++) {
-            tlv_bytes.push_back(bytes_[nbyte]);
-            nbyte++;
+          const ByteView tlv_bytes =
+              bytes.subview(nbyte, std::min<std::size_t>(len, bytes.size() - nbyte));
+          nbyte += tlv_bytes.size();
+          if (!tlv_bytes.empty()) {
+            if (!has_group_data)
+              record.begin_array("group_data");
+            has_group_data = true;
+            record.add_bytes(tlv_bytes);
           }
-          nlohmann::ordered_json group_data(BytesToHexString(tlv_bytes));
-          if (!tlv_bytes.empty())
-            json["long_message"]["group_data"].push_back(group_data);
         }
       }
+      if (has_group_data)
+        record.end_array();
     } else {
-      json["long_message"]["l4data"] = BytesToHexString(bytes_);
+      record.add_bytes("l4data", bytes);
     }
   } else {
-    json["long_message"]["l4data"] = BytesToHexString(bytes_);
+    record.add_bytes("l4data", bytes);
   }
-
-  return json;
+  record.end_object();
 }
 
-Layer3::Layer3(const Options& options) : options_(options) {}
+Layer3::Layer3(const Options& options, RecordSink& output)
+    : options_(options),
+      output_(output),
+      writer_(CreateRecordWriter(options.output_type)),
+      filter_(options),
+      long_message_(&filter_),
+      carousel_cache_(&filter_),
+      timestamp_formatter_(options.time_format),
+      start_time_(std::chrono::system_clock::now()) {}
 
 void Layer3::push_block(const L2Block& l2block) {
-  const Bits info_bits = l2block.information_bits();
+  sample_position_ = l2block.sample_position();
+  const std::chrono::duration<double> stream_time(sample_position_ / kTargetSampleRate_Hz);
+  rx_time_ =
+      start_time_ + std::chrono::duration_cast<std::chrono::system_clock::duration>(stream_time);
+
+  if (options_.bler)
+    block_error_rate_.push(l2block);
 
-  const std::uint16_t silch = field(info_bits, 0, 4);
+  const ByteView info_bytes = l2block.information_bytes();
+
+  const L3HeaderView header(info_bytes);
+  const int silch = header.silch();
+  if (!filter_.accepts_channel(silch))
+    return;
 
   if (silch == 0x8) {
-    service_message_.push_block(SechBlock(info_bits));
+    if (!filter_.accepts_service_type(header.data_type()))
+      return;
 
-    if (service_message_.is_complete())
-      print_line(service_message_.to_json());
+    service_message_.push_block(SechBlock(info_bytes));
+
+    if (service_message_.is_complete() && !is_unchanged_repeat(service_message_))
+      print_record([this](RecordWriter& record) { service_message_.write(record); });
 
   } else if (silch == 0x9) {
     /*printf("SMCh ");
     short_message_.push_block(ShortBlock(info_bits));
 
     if (short_message_.is_complete())
-      print_line(short_message_.to_json());*/
+      print_record(...);*/
 
   } else if (silch == 0xA) {
-    long_message_.push_block(LongBlock(info_bits));
+    const LongBlock block(info_bytes);
 
-    if (long_message_.is_complete())
-      print_line(long_message_.to_json());
+    if (options_.carousel) {
+      if (carousel_cache_.push_block(block)) {
+        long_message_.assign(carousel_cache_.frame());
+        handle_long_message();
+      }
+    } else {
+      long_message_.push_block(block);
+      handle_long_message();
+    }
 
   } else if (silch == 0xB) {
-    // bool is_realtime = field(info_bits, 4, 1);
-    int subchannel = field(info_bits, 5, 3);
-    if (subchannel == 0x0) {
-      const Bits data(info_bits.begin() + 8, info_bits.end());
-      nlohmann::ordered_json json;
-
-      json["block_app"]["l3data"] = BitsToHexString(data);
-      print_line(json);
+    // bool is_realtime = packed_field(info_bytes, 4, 1);
+    if (header.subchannel() == 0x0 && filter_.accepts_block_app()) {
+      print_record([info_bytes](RecordWriter& record) {
+        record.begin_object("block_app");
+        record.add_bytes("l3data", info_bytes.subview(1, 21));
+        record.end_object();
+      });
     }
-    // printf("subch:%d ", subchannel);
   } else {
   }
 }
 
-void Layer3::print_line(nlohmann::ordered_json json) {
-  if (options_.timestamp)
-    json["rx_time"] = TimePointToString(std::chrono::system_clock::now(), options_.time_format);
+void Layer3::handle_long_message() {
+  if (!long_message_.is_complete())
+    return;
+
+  if (long_message_.is_first() && long_message_.is_last()) {
+    print_record([this](RecordWriter& record) { long_message_.write(record); });
+  } else if (fragment_reassembler_.push_frame(long_message_, rx_time_)) {
+    print_record([this](RecordWriter& record) {
+      WriteL4Message(record, fragment_reassembler_.message(), true, true);
+    });
+  }
+}
+
+// Unchanged service messages are only repeated once per heartbeat interval (or
+// never, if it's zero)
+bool Layer3::is_unchanged_repeat(const ServiceMessage& message) {
+  if (!options_.changes_only)
+    return false;
+
+  const int key = (message.country_id() << 8) | (message.network_id() << 4) | message.data_type();
+
+  const std::uint64_t hash = message.content_hash(options_.ignore_tdt_clock);
+  const auto now           = rx_time_;
+
+  const auto emitted = emitted_service_messages_.find(key);
+  if (emitted != emitted_service_messages_.end() && emitted->second.hash == hash &&
+      (options_.heartbeat_s == 0 ||
+       now - emitted->second.time < std::chrono::seconds(options_.heartbeat_s)))
+    return true;
+
+  emitted_service_messages_[key] = {hash, now};
+  return false;
+}
+
+// A record that can't be serialized, because of a string that isn't valid
+// UTF-8, is replaced by a debug message. Records are built in full before being
+// written, so no incomplete records get printed.
+template <typename WriteFields>
+void Layer3::print_record(const WriteFields& write_fields) {
+  const std::uint64_t sequence_number = next_sequence_number_++;
 
   try {
-    // nlohmann::operator<< throws if a string contains non-UTF8 data.
-    // It's better to throw while writing to a stringstream; otherwise
-    // incomplete JSON objects could get printed.
-    std::stringstream output_proxy_stream;
-    output_proxy_stream << json;
-    std::cout << output_proxy_stream.str() << std::endl;
-  } catch (const std::exception& e) {
-    nlohmann::ordered_json json_from_exception;
-    json_from_exception["debug"] = std::string(e.what());
-    std::cout << json_from_exception << std::endl;
+    writer_->begin_record();
+    if (options_.stream_id >= 0)
+      writer_->add("stream", options_.stream_id);
+    if (options_.sequence)
+      writer_->add("seq", sequence_number);
+    write_fields(*writer_);
+    if (options_.bler)
+      writer_->add("bler", block_error_rate_.percent());
+    if (options_.timestamp)
+      writer_->add("rx_time", timestamp_formatter_.format(rx_time_));
+    if (options_.sequence)
+      writer_->add("sample", sample_position_);
+    if (options_.latency)
+      writer_->add("latency_ms",
+                   static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                        std::chrono::system_clock::now() - rx_time_)
+                                        .count()));
+    writer_->end_record();
+  } catch (const InvalidUtf8Error& e) {
+    writer_->begin_record();
+    if (options_.stream_id >= 0)
+      writer_->add("stream", options_.stream_id);
+    if (options_.sequence)
+      writer_->add("seq", sequence_number);
+    writer_->add("debug", e.what());
+    writer_->end_record();
   }
+
+  output_.write_record(writer_->record());
 }
 
 // EN 50067:1998, Annex D, Table D.1 (p. 71)
 // RDS Forum R08/008_7, Table D.2 (p. 75)
-std::string CountryString(std::uint16_t cid, std::uint16_t ecc) {
-  static const std::map<std::uint16_t, std::vector<std::string>> country_codes({
-      {0xA0,
-       {"us", "us", "us", "us", "us", "us", "us", "us", "us", "us", "us", "--", "us", "us", "--"}},
-      {0xA1,
-       {"--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "ca", "ca", "ca", "ca", "gl"}},
-      {0xA2,
-       {"ai", "ag", "ec", "fk", "bb", "bz", "ky", "cr", "cu", "ar", "br", "bm", "an", "gp", "bs"}},
-      {0xA3,
-       {"bo", "co", "jm", "mq", "gf", "py", "ni", "--", "pa", "dm", "do", "cl", "gd", "tc", "gy"}},
-      {0xA4,
-       {"gt", "hn", "aw", "--", "ms", "tt", "pe", "sr", "uy", "kn", "lc", "sv", "ht", "ve", "--"}},
-      {0xA5,
-       {"--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "mx", "vc", "mx", "mx", "mx"}},
-      {0xA6,
-       {"--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "pm"}},
-      {0xD0,
-       {"cm", "cf", "dj", "mg", "ml", "ao", "gq", "ga", "gn", "za", "bf", "cg", "tg", "bj", "mw"}},
-      {0xD1,
-       {"na", "lr", "gh", "mr", "st", "cv", "sn", "gm", "bi", "--", "bw", "km", "tz", "et", "bg"}},
-      {0xD2,
-       {"sl", "zw", "mz", "ug", "sz", "ke", "so", "ne", "td", "gw", "zr", "ci", "tz", "zm", "--"}},
-      {0xD3,
-       {"--", "--", "eh", "--", "rw", "ls", "--", "sc", "--", "mu", "--", "sd", "--", "--", "--"}},
-      {0xE0,
-       {"de", "dz", "ad", "il", "it", "be", "ru", "ps", "al", "at", "hu", "mt", "de", "--", "eg"}},
-      {0xE1,
-       {"gr", "cy", "sm", "ch", "jo", "fi", "lu", "bg", "dk", "gi", "iq", "gb", "ly", "ro", "fr"}},
-      {0xE2,
-       {"ma", "cz", "pl", "va", "sk", "sy", "tn", "--", "li", "is", "mc", "lt", "rs", "es", "no"}},
-      {0xE3,
-       {"me", "ie", "tr", "mk", "--", "--", "--", "nl", "lv", "lb", "az", "hr", "kz", "se", "by"}},
-      {0xE4,
-       {"md", "ee", "kg", "--", "--", "ua", "ks", "pt", "si", "am", "--", "ge", "--", "--", "ba"}},
-      {0xF0,
-       {"au", "au", "au", "au", "au", "au", "au", "au", "sa", "af", "mm", "cn", "kp", "bh", "my"}},
-      {0xF1,
-       {"ki", "bt", "bd", "pk", "fj", "om", "nr", "ir", "nz", "sb", "bn", "lk", "tw", "kr", "hk"}},
-      {0xF2,
-       {"kw", "qa", "kh", "ws", "in", "mo", "vn", "ph", "jp", "sg", "mv", "id", "ae", "np", "vu"}},
-      {0xF3,
-       {"la", "th", "to", "--", "--", "--", "--", "--", "pg", "--", "ye", "--", "--", "fm",
-        "mn"}                                                                                    }
-  });
-
-  std::string result("--");
-
-  if (country_codes.find(ecc) != country_codes.end() && cid > 0) {
-    result = country_codes.at(ecc).at(cid - 1);
-  }
-
-  return result;
+struct CountryCodeRow {
+  std::uint16_t ecc;
+  std::array<const char*, 15> codes;  // For country ids 1 to 15
+};
+
+constexpr std::array<CountryCodeRow, 20> kCountryCodes({{
+    {0xA0,
+     {"us", "us", "us", "us", "us", "us", "us", "us", "us", "us", "us", "--", "us", "us", "--"}},
+    {0xA1,
+     {"--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "ca", "ca", "ca", "ca", "gl"}},
+    {0xA2,
+     {"ai", "ag", "ec", "fk", "bb", "bz", "ky", "cr", "cu", "ar", "br", "bm", "an", "gp", "bs"}},
+    {0xA3,
+     {"bo", "co", "jm", "mq", "gf", "py", "ni", "--", "pa", "dm", "do", "cl", "gd", "tc", "gy"}},
+    {0xA4,
+     {"gt", "hn", "aw", "--", "ms", "tt", "pe", "sr", "uy", "kn", "lc", "sv", "ht", "ve", "--"}},
+    {0xA5,
+     {"--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "mx", "vc", "mx", "mx", "mx"}},
+    {0xA6,
+     {"--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "--", "pm"}},
+    {0xD0,
+     {"cm", "cf", "dj", "mg", "ml", "ao", "gq", "ga", "gn", "za", "bf", "cg", "tg", "bj", "mw"}},
+    {0xD1,
+     {"na", "lr", "gh", "mr", "st", "cv", "sn", "gm", "bi", "--", "bw", "km", "tz", "et", "bg"}},
+    {0xD2,
+     {"sl", "zw", "mz", "ug", "sz", "ke", "so", "ne", "td", "gw", "zr", "ci", "tz", "zm", "--"}},
+    {0xD3,
+     {"--", "--", "eh", "--", "rw", "ls", "--", "sc", "--", "mu", "--", "sd", "--", "--", "--"}},
+    {0xE0,
+     {"de", "dz", "ad", "il", "it", "be", "ru", "ps", "al", "at", "hu", "mt", "de", "--", "eg"}},
+    {0xE1,
+     {"gr", "cy", "sm", "ch", "jo", "fi", "lu", "bg", "dk", "gi", "iq", "gb", "ly", "ro", "fr"}},
+    {0xE2,
+     {"ma", "cz", "pl", "va", "sk", "sy", "tn", "--", "li", "is", "mc", "lt", "rs", "es", "no"}},
+    {0xE3,
+     {"me", "ie", "tr", "mk", "--", "--", "--", "nl", "lv", "lb", "az", "hr", "kz", "se", "by"}},
+    {0xE4,
+     {"md", "ee", "kg", "--", "--", "ua", "ks", "pt", "si", "am", "--", "ge", "--", "--", "ba"}},
+    {0xF0,
+     {"au", "au", "au", "au", "au", "au", "au", "au", "sa", "af", "mm", "cn", "kp", "bh", "my"}},
+    {0xF1,
+     {"ki", "bt", "bd", "pk", "fj", "om", "nr", "ir", "nz", "sb", "bn", "lk", "tw", "kr", "hk"}},
+    {0xF2,
+     {"kw", "qa", "kh", "ws", "in", "mo", "vn", "ph", "jp", "sg", "mv", "id", "ae", "np", "vu"}},
+    {0xF3,
+     {"la", "th", "to", "--", "--", "--", "--", "--", "pg", "--", "ye", "--", "--", "fm", "mn"}},
+}});
+
+const char* CountryString(std::uint16_t cid, std::uint16_t ecc) {
+  if (cid == 0 || cid > 15)
+    return "--";
+
+  for (const CountryCodeRow& row : kCountryCodes)
+    if (row.ecc == ecc)
+      return row.codes[cid - 1];
+
+  return "--";
 }
 
 }  // namespace darc2json
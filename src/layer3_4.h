@@ -20,31 +20,63 @@
 #include <array>
 #include <chrono>
 #include <cstdint>
+#include <map>
 #include <memory>
 #include <vector>
 
-#include <nlohmann/json.hpp>
-
 #include "config.h"
 
 #include "src/layer2.h"
+#include "src/output.h"
 #include "src/util.h"
 
 namespace darc2json {
 
 enum eSechDataType { kTypeCOT = 0, kTypeAFT, kTypeSAFT, kTypeTDPNT, kTypeSNT, kTypeTDT, kTypeSCOT };
 
+constexpr std::array<const char*, 7> kSechTypeNames = {"COT", "AFT", "SAFT", "TDPNT",
+                                                       "SNT", "TDT", "SCOT"};
+
+// Long message frames of L5 group data have this type
+constexpr int kL4TypeGroupData = 12;
+
+// Decides which messages to decode, by the --silch, --data-type and
+// --transport-id options, as early as their headers allow. The data type is
+// that of service messages or of L4 long messages; transport ids only belong
+// to group data. Messages without the field are dropped when it is filtered on.
+class DecodeFilter {
+ public:
+  explicit DecodeFilter(const Options& options);
+  bool accepts_channel(int silch) const;
+  bool accepts_service_type(int data_type) const;
+  // Blocks on the block application channel have neither field
+  bool accepts_block_app() const;
+  // Called with the first block of each long message frame, in order. The
+  // continuation fragments of a fragmented message follow the decision made
+  // on its first fragment, by channel id.
+  bool accepts_frame(ByteView frame_start);
+
+ private:
+  static bool Contains(const std::vector<int>& list, int value);
+
+  std::vector<int> silchs_;
+  std::vector<int> data_types_;
+  std::vector<int> transport_ids_;
+  std::array<bool, 4> is_channel_accepted_{};
+};
+
+// A view into the information bytes of a service channel block. It is only
+// valid as long as the L2 block it was created from.
 class SechBlock {
  public:
-  SechBlock(const Bits& info_bits);
+  explicit SechBlock(ByteView info_bytes);
   bool is_last_fragment() const;
   int block_num() const;
+  int data_update() const;
   int country_id() const;
   int data_type() const;
   int network_id() const;
-  Bits data_bits() const;
-
-  bool follows_in_sequence(const SechBlock& previous) const;
+  ByteView data_bytes() const;
 
  private:
   bool is_last_fragment_;
@@ -53,7 +85,7 @@ class SechBlock {
   int data_type_;
   int network_id_;
   int block_num_;
-  Bits data_;
+  ByteView data_;
 };
 
 class ServiceMessage {
@@ -61,65 +93,210 @@ class ServiceMessage {
   ServiceMessage() = default;
   void push_block(const SechBlock& block);
   bool is_complete() const;
-  nlohmann::ordered_json to_json() const;
-  Bits data_bits() const;
+  void write(RecordWriter& record) const;
+  ByteView data_bytes() const;
+  std::uint64_t content_hash(bool ignore_tdt_clock) const;
   int country_id() const;
   int network_id() const;
   int data_type() const;
 
  private:
-  std::vector<SechBlock> blocks_;
-  bool is_complete_;
+  static constexpr std::size_t kBytesPerBlock = 19;
+  static constexpr int kMaxNumBlocks          = 16;
+
+  void clear();
+  bool follows_in_sequence(const SechBlock& block) const;
+
+  std::array<std::uint8_t, kMaxNumBlocks * kBytesPerBlock> data_{};
+  int num_blocks_{};
+  int data_update_{};
+  int country_id_{};
+  int data_type_{};
+  int network_id_{};
+  bool is_complete_{};
 };
 
+// A view into the information bytes of a long message channel block. It is
+// only valid as long as the L2 block it was created from.
 class LongBlock {
  public:
-  LongBlock(const Bits& info_bits);
+  explicit LongBlock(ByteView info_bytes);
   bool is_last_fragment() const;
   bool header_crc_ok() const;
-  Bits data() const;
-
-  bool follows_in_sequence(const LongBlock& previous) const;
+  int sequence_counter() const;
+  ByteView data() const;
 
  private:
   bool is_last_fragment_;
   int sequence_counter_;
   bool l3_header_crc_ok_;
-  std::vector<std::uint8_t> bytes_;
+  ByteView bytes_;
 };
 
+// One L4 frame, reassembled from consecutive long message channel blocks. If
+// the filter rejects a frame by its first block, the rest are only followed by
+// their sequence counters and the frame never completes.
 class LongMessage {
  public:
-  LongMessage();
+  explicit LongMessage(DecodeFilter* filter = nullptr);
   void push_block(const LongBlock& block);
+  void assign(ByteView frame);
   bool is_complete() const;
-  nlohmann::ordered_json to_json() const;
+  bool is_first() const;
+  bool is_last() const;
+  int channel_id() const;
+  std::size_t header_length() const;
+  std::size_t data_length() const;
+  void write(RecordWriter& record) const;
+  ByteView bytes() const;
 
  private:
+  static constexpr std::size_t kMaxNumBytes = 4096;
+
+  void clear();
+  bool follows_in_sequence(const LongBlock& block) const;
   void parse_l4_header();
 
   bool is_complete_;
-  std::vector<LongBlock> blocks_;
-  Bytes bytes_;
+  std::array<std::uint8_t, kMaxNumBytes> bytes_{};
+  std::size_t num_bytes_{};
+  int num_blocks_{};
+  int last_sequence_counter_{};
+  bool last_was_final_{};
   bool is_first_;
   bool is_last_;
+  int channel_id_{};
+  std::size_t header_length_{};
+  std::size_t data_length_{};
   bool l4_header_crc_ok_;
+  DecodeFilter* filter_;
+  bool is_rejected_{};
+};
+
+// Joins the L4 frames of fragmented L5 messages. Frames of up to four messages
+// may be interleaved; they are told apart by the channel identifier, the only
+// identifier every fragment carries.
+class FragmentReassembler {
+ public:
+  FragmentReassembler() = default;
+  // Returns true if `frame` completed a message, which stays available via
+  // message() until the next call. `rx_time` is when the frame was received,
+  // going by the sample position, so that the age limit holds in signal time
+  // even when the input is decoded faster than real time.
+  bool push_frame(const LongMessage& frame, std::chrono::system_clock::time_point rx_time);
+  ByteView message() const;
+
+ private:
+  static constexpr int kNumChannels             = 4;
+  static constexpr std::size_t kMaxMessageBytes = 32 * 1024;
+  static constexpr std::size_t kMaxTotalBytes   = 64 * 1024;
+  // Partial messages not updated for this long are dropped
+  static constexpr std::chrono::seconds kMaxAge{30};
+
+  struct PartialMessage {
+    std::vector<std::uint8_t> bytes;
+    std::chrono::system_clock::time_point last_update;
+  };
+
+  void drop(int channel_id);
+  void expire(std::chrono::system_clock::time_point now);
+  void make_room(std::size_t num_bytes, int keep_channel_id);
+
+  std::array<PartialMessage, kNumChannels> partial_messages_;
+  std::size_t total_bytes_{};
+  std::vector<std::uint8_t> message_;
 };
 
+// Completes L4 frames that a data service repeats in a carousel, by merging
+// the long message blocks received in each transmission. A frame is identified
+// by the contents of its first block, and later blocks are placed by their
+// sequence counter. Each frame is only emitted again if its content changes.
+// Transmissions of frames that the filter rejects by their first block are not
+// cached.
+class CarouselCache {
+ public:
+  explicit CarouselCache(DecodeFilter* filter = nullptr);
+  // Returns true if `block` completed a new frame, which stays available via
+  // frame() until the next call
+  bool push_block(const LongBlock& block);
+  ByteView frame() const;
+
+ private:
+  static constexpr std::size_t kBytesPerBlock = 20;
+  static constexpr int kMaxNumBlocks          = 4096 / kBytesPerBlock;
+  static constexpr std::size_t kMaxTotalBytes = 1024 * 1024;
+
+  struct CachedFrame {
+    std::vector<std::uint8_t> bytes;
+    std::vector<bool> received;
+    int num_blocks{};  // Zero until the last block is seen
+    bool emitted{};
+    std::uint64_t emitted_hash{};
+    std::uint64_t last_use{};
+  };
+
+  static std::size_t MemoryUsage(const CachedFrame& frame);
+
+  bool place_block(CachedFrame& frame, int position, const LongBlock& block);
+  void evict_least_recently_used();
+
+  DecodeFilter* filter_;
+  std::map<std::uint64_t, CachedFrame> frames_;
+  std::size_t total_bytes_{};
+  std::uint64_t use_counter_{};
+
+  // The transmission currently being received
+  bool in_frame_{};
+  bool is_rejected_{};
+  std::uint64_t frame_id_{};
+  int position_{};
+  int previous_sequence_counter_{-1};
+  bool previous_was_last_{};
+
+  ByteView completed_frame_;
+};
+
+void WriteL4Message(RecordWriter& record, ByteView bytes, bool is_first, bool is_last);
+
 class Layer3 {
  public:
-  Layer3(const Options& options);
+  Layer3(const Options& options, RecordSink& output);
   ~Layer3() = default;
   void push_block(const L2Block& block);
-  void print_line(nlohmann::ordered_json json);
 
  private:
+  struct EmittedMessage {
+    std::uint64_t hash;
+    std::chrono::system_clock::time_point time;
+  };
+
+  bool is_unchanged_repeat(const ServiceMessage& message);
+  void handle_long_message();
+  template <typename WriteFields>
+  void print_record(const WriteFields& write_fields);
+
   Options options_;
+  RecordSink& output_;
+  std::unique_ptr<RecordWriter> writer_;
+  DecodeFilter filter_;
   ServiceMessage service_message_;
+  // Last emitted service message per (country, network, type)
+  std::map<int, EmittedMessage> emitted_service_messages_;
   LongMessage long_message_;
+  FragmentReassembler fragment_reassembler_;
+  CarouselCache carousel_cache_;
+  BlockErrorRate block_error_rate_;
+  TimestampFormatter timestamp_formatter_;
+
+  // Reception time of the current block: the stream is taken to start when
+  // the decoder is created, and time advances with the sample position
+  std::chrono::system_clock::time_point start_time_;
+  std::chrono::system_clock::time_point rx_time_;
+  std::uint64_t sample_position_{};
+  std::uint64_t next_sequence_number_{};
 };
 
-std::string CountryString(std::uint16_t cid, std::uint16_t ecc);
+const char* CountryString(std::uint16_t cid, std::uint16_t ecc);
 
 }  // namespace darc2json
 
@@ -0,0 +1,592 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#include "src/output.h"
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "src/common.h"
+#include "src/sinks.h"
+#include "src/util.h"
+
+namespace darc2json {
+
+namespace {
+
+// How often the writer thread gives sinks a chance to send pending data
+constexpr std::chrono::milliseconds kSinkPollInterval(100);
+
+enum class CharClass : std::uint8_t { Plain, Escaped, NonAscii };
+
+constexpr std::array<CharClass, 256> kCharClasses = [] {
+  std::array<CharClass, 256> classes{};
+  for (int c = 0; c < 256; c++) {
+    if (c < 0x20 || c == '"' || c == '\\')
+      classes[c] = CharClass::Escaped;
+    else if (c >= 0x80)
+      classes[c] = CharClass::NonAscii;
+  }
+  return classes;
+}();
+
+std::string HexByte(std::uint8_t byte) {
+  constexpr char kHexDigits[] = "0123456789ABCDEF";
+  return {kHexDigits[byte >> 4], kHexDigits[byte & 0xF]};
+}
+
+void AppendEscaped(std::string& buffer, std::uint8_t c) {
+  switch (c) {
+    case 0x08: buffer += "\\b"; break;
+    case 0x09: buffer += "\\t"; break;
+    case 0x0A: buffer += "\\n"; break;
+    case 0x0C: buffer += "\\f"; break;
+    case 0x0D: buffer += "\\r"; break;
+    case '"':  buffer += "\\\""; break;
+    case '\\': buffer += "\\\\"; break;
+    default:
+      constexpr char kHexDigits[] = "0123456789abcdef";
+      buffer += "\\u00";
+      buffer += kHexDigits[c >> 4];
+      buffer += kHexDigits[c & 0xF];
+      break;
+  }
+}
+
+const std::string kUtf8ErrorPrefix("[json.exception.type_error.316] ");
+
+// Check the multi-byte UTF-8 sequence that starts at string[start] against the
+// well-formed byte ranges (Unicode Table 3-7)
+// \return Index just past the sequence
+std::size_t Utf8SequenceEnd(std::string_view string, std::size_t start) {
+  const auto lead = static_cast<std::uint8_t>(string[start]);
+
+  int num_continuation_bytes = 0;
+  std::uint8_t second_min    = 0x80;
+  std::uint8_t second_max    = 0xBF;
+  if (lead >= 0xC2 && lead <= 0xDF) {
+    num_continuation_bytes = 1;
+  } else if (lead >= 0xE0 && lead <= 0xEF) {
+    num_continuation_bytes = 2;
+    second_min             = (lead == 0xE0 ? 0xA0 : 0x80);
+    second_max             = (lead == 0xED ? 0x9F : 0xBF);
+  } else if (lead >= 0xF0 && lead <= 0xF4) {
+    num_continuation_bytes = 3;
+    second_min             = (lead == 0xF0 ? 0x90 : 0x80);
+    second_max             = (lead == 0xF4 ? 0x8F : 0xBF);
+  } else {
+    throw InvalidUtf8Error(kUtf8ErrorPrefix + "invalid UTF-8 byte at index " +
+                           std::to_string(start) + ": 0x" + HexByte(lead));
+  }
+
+  for (int n = 1; n <= num_continuation_bytes; n++) {
+    const std::size_t i = start + n;
+    if (i >= string.size()) {
+      throw InvalidUtf8Error(kUtf8ErrorPrefix + "incomplete UTF-8 string; last byte: 0x" +
+                             HexByte(string.back()));
+    }
+    const auto continuation = static_cast<std::uint8_t>(string[i]);
+    const std::uint8_t min  = (n == 1 ? second_min : 0x80);
+    const std::uint8_t max  = (n == 1 ? second_max : 0xBF);
+    if (continuation < min || continuation > max) {
+      throw InvalidUtf8Error(kUtf8ErrorPrefix + "invalid UTF-8 byte at index " +
+                             std::to_string(i) + ": 0x" + HexByte(continuation));
+    }
+  }
+
+  return start + num_continuation_bytes + 1;
+}
+
+// Write out the whole of every buffer, resuming after partial writes. Gives up
+// if the output is gone.
+void WriteAll(std::vector<iovec>& buffers) {
+  std::size_t n_first = 0;
+  while (n_first < buffers.size()) {
+    const ssize_t num_written =
+        ::writev(STDOUT_FILENO, &buffers[n_first], static_cast<int>(buffers.size() - n_first));
+    if (num_written < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    auto num_left = static_cast<std::size_t>(num_written);
+    while (n_first < buffers.size() && num_left >= buffers[n_first].iov_len) {
+      num_left -= buffers[n_first].iov_len;
+      n_first++;
+    }
+    if (n_first < buffers.size()) {
+      buffers[n_first].iov_base = static_cast<char*>(buffers[n_first].iov_base) + num_left;
+      buffers[n_first].iov_len -= num_left;
+    }
+  }
+}
+
+// Write a batch of records to stdout with as few system calls as possible
+void WriteBatch(const std::deque<std::string>& records) {
+  constexpr std::size_t kMaxBuffersPerWrite = 1024;
+
+  std::vector<iovec> buffers;
+  buffers.reserve(std::min(records.size(), kMaxBuffersPerWrite));
+  for (auto record = records.cbegin(); record != records.cend();) {
+    buffers.clear();
+    for (; record != records.cend() && buffers.size() < kMaxBuffersPerWrite; ++record)
+      buffers.push_back({const_cast<char*>(record->data()), record->size()});
+    WriteAll(buffers);
+  }
+}
+
+}  // namespace
+
+void JsonWriter::begin_record() {
+  buffer_.clear();
+  buffer_ += '{';
+  needs_separator_ = false;
+}
+
+void JsonWriter::end_record() {
+  buffer_ += "}\n";
+}
+
+void JsonWriter::begin_object(std::string_view key) {
+  write_key(key);
+  buffer_ += '{';
+  needs_separator_ = false;
+}
+
+void JsonWriter::end_object() {
+  buffer_ += '}';
+  needs_separator_ = true;
+}
+
+void JsonWriter::begin_array(std::string_view key) {
+  write_key(key);
+  buffer_ += '[';
+  needs_separator_ = false;
+}
+
+void JsonWriter::end_array() {
+  buffer_ += ']';
+  needs_separator_ = true;
+}
+
+void JsonWriter::add(std::string_view key, bool value) {
+  write_key(key);
+  buffer_ += (value ? "true" : "false");
+  needs_separator_ = true;
+}
+
+void JsonWriter::add(std::string_view key, int value) {
+  write_key(key);
+  char digits[12];
+  const auto result = std::to_chars(std::begin(digits), std::end(digits), value);
+  buffer_.append(digits, result.ptr);
+  needs_separator_ = true;
+}
+
+void JsonWriter::add(std::string_view key, std::uint64_t value) {
+  write_key(key);
+  char digits[20];
+  const auto result = std::to_chars(std::begin(digits), std::end(digits), value);
+  buffer_.append(digits, result.ptr);
+  needs_separator_ = true;
+}
+
+void JsonWriter::add(std::string_view key, std::string_view value) {
+  write_key(key);
+  write_string(value);
+  needs_separator_ = true;
+}
+
+void JsonWriter::add_bytes(std::string_view key, ByteView bytes) {
+  write_key(key);
+  write_hex_string(bytes);
+  needs_separator_ = true;
+}
+
+void JsonWriter::add_bytes(ByteView bytes) {
+  write_separator();
+  write_hex_string(bytes);
+  needs_separator_ = true;
+}
+
+std::string_view JsonWriter::record() const {
+  return buffer_;
+}
+
+void JsonWriter::write_separator() {
+  if (needs_separator_)
+    buffer_ += ',';
+}
+
+void JsonWriter::write_key(std::string_view key) {
+  write_separator();
+  write_string(key);
+  buffer_ += ':';
+}
+
+// Runs of plain ASCII are copied as is
+void JsonWriter::write_string(std::string_view string) {
+  buffer_ += '"';
+
+  std::size_t run_start = 0;
+  std::size_t i         = 0;
+  while (i < string.size()) {
+    const auto byte            = static_cast<std::uint8_t>(string[i]);
+    const CharClass char_class = kCharClasses[byte];
+    if (char_class == CharClass::Plain) {
+      i++;
+      continue;
+    }
+
+    buffer_.append(string.data() + run_start, i - run_start);
+
+    if (char_class == CharClass::Escaped) {
+      AppendEscaped(buffer_, byte);
+      run_start = ++i;
+    } else {
+      run_start = i;
+      i         = Utf8SequenceEnd(string, i);
+    }
+  }
+  buffer_.append(string.data() + run_start, string.size() - run_start);
+
+  buffer_ += '"';
+}
+
+void JsonWriter::write_hex_string(ByteView bytes) {
+  buffer_ += '"';
+  AppendHexString(buffer_, bytes);
+  buffer_ += '"';
+}
+
+// Room is left for the length prefix, which is filled in at the end
+void CborWriter::begin_record() {
+  buffer_.assign(4, '\0');
+  containers_.clear();
+  begin_container(5);
+}
+
+void CborWriter::end_record() {
+  end_container(5);
+
+  const std::uint32_t length = buffer_.size() - 4;
+  for (int n = 0; n < 4; n++) buffer_[n] = static_cast<char>(length >> (24 - 8 * n));
+}
+
+void CborWriter::begin_object(std::string_view key) {
+  write_key(key);
+  begin_container(5);
+}
+
+void CborWriter::end_object() {
+  end_container(5);
+}
+
+void CborWriter::begin_array(std::string_view key) {
+  write_key(key);
+  begin_container(4);
+}
+
+void CborWriter::end_array() {
+  end_container(4);
+}
+
+void CborWriter::add(std::string_view key, bool value) {
+  write_key(key);
+  buffer_ += static_cast<char>(value ? 0xF5 : 0xF4);
+}
+
+void CborWriter::add(std::string_view key, int value) {
+  write_key(key);
+  if (value >= 0)
+    write_head(0, value);
+  else
+    write_head(1, -1 - static_cast<std::int64_t>(value));
+}
+
+void CborWriter::add(std::string_view key, std::uint64_t value) {
+  write_key(key);
+  write_head(0, value);
+}
+
+void CborWriter::add(std::string_view key, std::string_view value) {
+  write_key(key);
+  write_text(value);
+}
+
+void CborWriter::add_bytes(std::string_view key, ByteView bytes) {
+  write_key(key);
+  write_head(2, bytes.size());
+  buffer_.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+void CborWriter::add_bytes(ByteView bytes) {
+  containers_.back().num_items++;
+  write_head(2, bytes.size());
+  buffer_.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+std::string_view CborWriter::record() const {
+  return buffer_;
+}
+
+// Initial byte of a data item, followed by its argument in the shortest form
+void CborWriter::write_head(int major_type, std::uint64_t value) {
+  const auto initial_byte = static_cast<char>(major_type << 5);
+  if (value < 24) {
+    buffer_ += static_cast<char>(initial_byte | value);
+    return;
+  }
+
+  // Additional information 24, 25, 26 and 27 mean 1, 2, 4 and 8 bytes follow
+  int num_bytes       = 1;
+  int additional_info = 24;
+  while (num_bytes < 8 && (value >> (8 * num_bytes)) != 0) {
+    num_bytes *= 2;
+    additional_info++;
+  }
+  buffer_ += static_cast<char>(initial_byte | additional_info);
+  for (int n = num_bytes - 1; n >= 0; n--) buffer_ += static_cast<char>(value >> (8 * n));
+}
+
+// Each key/value pair counts as one item of the enclosing map
+void CborWriter::write_key(std::string_view key) {
+  containers_.back().num_items++;
+  write_text(key);
+}
+
+void CborWriter::write_text(std::string_view text) {
+  for (std::size_t i = 0; i < text.size();)
+    i = (kCharClasses[static_cast<std::uint8_t>(text[i])] == CharClass::NonAscii)
+            ? Utf8SequenceEnd(text, i)
+            : i + 1;
+
+  write_head(3, text.size());
+  buffer_.append(text);
+}
+
+// The length isn't known until the container ends, so a one-byte head is
+// written now and widened later if needed
+void CborWriter::begin_container(int major_type) {
+  containers_.push_back({buffer_.size(), 0});
+  buffer_ += static_cast<char>(major_type << 5);
+}
+
+void CborWriter::end_container(int major_type) {
+  const Container container = containers_.back();
+  containers_.pop_back();
+
+  if (container.num_items < 24) {
+    buffer_[container.head_position] = static_cast<char>((major_type << 5) | container.num_items);
+  } else {
+    const std::size_t tail_start = buffer_.size();
+    write_head(major_type, container.num_items);
+    const std::string head = buffer_.substr(tail_start);
+    buffer_.resize(tail_start);
+    buffer_.replace(container.head_position, 1, head);
+  }
+}
+
+std::unique_ptr<RecordWriter> CreateRecordWriter(OutputType type) {
+  if (type == OutputType::Cbor)
+    return std::make_unique<CborWriter>();
+  return std::make_unique<JsonWriter>();
+}
+
+Output::Output(const Options& options)
+    : flush_policy_(options.flush_policy),
+      flush_interval_(options.flush_interval_ms),
+      flush_size_(options.flush_size),
+      last_flush_(std::chrono::steady_clock::now()),
+      is_stdout_enabled_(options.sink_specs.empty()),
+      queue_capacity_(options.output_queue_size),
+      queue_full_policy_(options.queue_full_policy) {
+  for (const std::string& spec : options.sink_specs) {
+    if (spec == "stdout")
+      is_stdout_enabled_ = true;
+    else
+      sinks_.push_back(CreateSink(spec, options));
+  }
+
+  if (queue_capacity_ > 0)
+    writer_ = std::thread(&Output::run_writer, this);
+}
+
+Output::~Output() {
+  if (queue_capacity_ == 0) {
+    flush();
+    return;
+  }
+
+  {
+    const std::lock_guard<std::mutex> lock(mutex_);
+    is_closing_ = true;
+  }
+  queue_changed_.notify_all();
+  writer_.join();
+
+  std::cerr << "output: " << num_dropped_ << " records dropped, at most " << max_queue_depth_
+            << " of " << queue_capacity_ << " queued" << '\n';
+}
+
+void Output::write_record(std::string_view record) {
+  if (queue_capacity_ > 0) {
+    enqueue(record);
+    return;
+  }
+
+  const std::lock_guard<std::mutex> lock(mutex_);
+  publish(record);
+  if (!is_stdout_enabled_)
+    return;
+
+  buffer_.append(record);
+
+  switch (flush_policy_) {
+    case FlushPolicy::Line: flush_buffer(); break;
+    case FlushPolicy::Interval:
+      if (std::chrono::steady_clock::now() - last_flush_ >= flush_interval_)
+        flush_buffer();
+      break;
+    case FlushPolicy::Size:
+      if (buffer_.size() >= flush_size_)
+        flush_buffer();
+      break;
+  }
+}
+
+void Output::poll() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  // With an output queue the sinks belong to the writer thread, which polls them
+  if (queue_capacity_ == 0)
+    for (const std::unique_ptr<RecordSink>& sink : sinks_) sink->poll();
+  if (flush_policy_ == FlushPolicy::Interval && !buffer_.empty() &&
+      std::chrono::steady_clock::now() - last_flush_ >= flush_interval_)
+    flush_buffer();
+}
+
+void Output::flush() {
+  const std::lock_guard<std::mutex> lock(mutex_);
+  flush_buffer();
+}
+
+void Output::publish(std::string_view record) {
+  for (const std::unique_ptr<RecordSink>& sink : sinks_) sink->write_record(record);
+}
+
+void Output::enqueue(std::string_view record) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (queue_.size() >= queue_capacity_) {
+    switch (queue_full_policy_) {
+      case QueueFullPolicy::Block:
+        queue_changed_.wait(lock, [this] { return queue_.size() < queue_capacity_; });
+        break;
+      case QueueFullPolicy::DropOldest:
+        num_queued_bytes_ -= queue_.front().size();
+        queue_.pop_front();
+        num_dropped_++;
+        break;
+      case QueueFullPolicy::DropNewest: num_dropped_++; return;
+    }
+  }
+
+  queue_.emplace_back(record);
+  num_queued_bytes_ += record.size();
+  max_queue_depth_ = std::max(max_queue_depth_, queue_.size());
+
+  if (is_batch_ready())
+    queue_changed_.notify_all();
+}
+
+// A full queue is always written out. Otherwise, with the interval policy the
+// writer wakes up on a timer.
+bool Output::is_batch_ready() const {
+  return !queue_.empty() &&
+         (queue_.size() >= queue_capacity_ || flush_policy_ == FlushPolicy::Line ||
+          (flush_policy_ == FlushPolicy::Size && num_queued_bytes_ >= flush_size_));
+}
+
+// Writer thread: take everything queued at once and write it outside the lock.
+// The sinks belong to this thread, so it also wakes up regularly to poll them.
+void Output::run_writer() {
+  std::deque<std::string> batch;
+  std::unique_lock<std::mutex> lock(mutex_);
+  const auto is_ready = [this] { return is_closing_ || is_batch_ready(); };
+
+  while (true) {
+    auto now = std::chrono::steady_clock::now();
+    if (flush_policy_ == FlushPolicy::Interval && !sinks_.empty())
+      queue_changed_.wait_until(
+          lock, std::min(last_flush_ + flush_interval_, now + kSinkPollInterval), is_ready);
+    else if (flush_policy_ == FlushPolicy::Interval)
+      queue_changed_.wait_until(lock, last_flush_ + flush_interval_, is_ready);
+    else if (!sinks_.empty())
+      queue_changed_.wait_until(lock, now + kSinkPollInterval, is_ready);
+    else
+      queue_changed_.wait(lock, is_ready);
+
+    now               = std::chrono::steady_clock::now();
+    const bool is_due = is_ready() || (flush_policy_ == FlushPolicy::Interval &&
+                                       now - last_flush_ >= flush_interval_);
+    if (is_due)
+      last_flush_ = now;
+    if (is_due && !queue_.empty()) {
+      batch.swap(queue_);
+      num_queued_bytes_ = 0;
+    } else if (is_closing_) {
+      break;
+    }
+    lock.unlock();
+
+    if (!batch.empty()) {
+      queue_changed_.notify_all();
+      if (is_stdout_enabled_)
+        WriteBatch(batch);
+      for (const std::string& record : batch) publish(record);
+      batch.clear();
+    }
+    for (const std::unique_ptr<RecordSink>& sink : sinks_) sink->poll();
+    lock.lock();
+  }
+}
+
+void Output::flush_buffer() {
+  if (!buffer_.empty()) {
+    std::fwrite(buffer_.data(), 1, buffer_.size(), stdout);
+    buffer_.clear();
+  }
+  std::fflush(stdout);
+  last_flush_ = std::chrono::steady_clock::now();
+}
+
+}  // namespace darc2json
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "src/common.h"
+#include "src/util.h"
+
+namespace darc2json {
+
+// Thrown for strings that aren't valid UTF-8. The message is the same as that of
+// nlohmann::json's type_error.316, which we used to serialize with.
+class InvalidUtf8Error : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
+// Builds one output record at a time into a reusable buffer. Records are
+// objects of named fields, written in order.
+class RecordWriter {
+ public:
+  virtual ~RecordWriter() = default;
+  // Start a new record, discarding the previous one
+  virtual void begin_record()                                    = 0;
+  virtual void end_record()                                      = 0;
+  virtual void begin_object(std::string_view key)                = 0;
+  virtual void end_object()                                      = 0;
+  virtual void begin_array(std::string_view key)                 = 0;
+  virtual void end_array()                                       = 0;
+  virtual void add(std::string_view key, bool value)             = 0;
+  virtual void add(std::string_view key, int value)              = 0;
+  virtual void add(std::string_view key, std::uint64_t value)    = 0;
+  virtual void add(std::string_view key, std::string_view value) = 0;
+  virtual void add_bytes(std::string_view key, ByteView bytes)   = 0;
+  // Array element
+  virtual void add_bytes(ByteView bytes)                         = 0;
+  // The finished record, including any framing
+  virtual std::string_view record() const                        = 0;
+
+  void add(std::string_view key, const char* value) {
+    add(key, std::string_view(value));
+  }
+};
+
+// Line-delimited JSON, byte for byte like a compact nlohmann::json dump. Bytes
+// are written as strings of space-separated hex ("01 2c 52").
+class JsonWriter : public RecordWriter {
+ public:
+  JsonWriter() = default;
+  void begin_record() override;
+  void end_record() override;
+  void begin_object(std::string_view key) override;
+  void end_object() override;
+  void begin_array(std::string_view key) override;
+  void end_array() override;
+  void add(std::string_view key, bool value) override;
+  void add(std::string_view key, int value) override;
+  void add(std::string_view key, std::uint64_t value) override;
+  void add(std::string_view key, std::string_view value) override;
+  void add_bytes(std::string_view key, ByteView bytes) override;
+  void add_bytes(ByteView bytes) override;
+  std::string_view record() const override;
+  using RecordWriter::add;
+
+ private:
+  void write_separator();
+  void write_key(std::string_view key);
+  void write_string(std::string_view string);
+  void write_hex_string(ByteView bytes);
+
+  std::string buffer_;
+  bool needs_separator_{};
+};
+
+// CBOR (RFC 8949) maps, each preceded by its length as a 32-bit big-endian
+// integer. Bytes are written as raw byte strings.
+class CborWriter : public RecordWriter {
+ public:
+  CborWriter() = default;
+  void begin_record() override;
+  void end_record() override;
+  void begin_object(std::string_view key) override;
+  void end_object() override;
+  void begin_array(std::string_view key) override;
+  void end_array() override;
+  void add(std::string_view key, bool value) override;
+  void add(std::string_view key, int value) override;
+  void add(std::string_view key, std::uint64_t value) override;
+  void add(std::string_view key, std::string_view value) override;
+  void add_bytes(std::string_view key, ByteView bytes) override;
+  void add_bytes(ByteView bytes) override;
+  std::string_view record() const override;
+  using RecordWriter::add;
+
+ private:
+  // A map or array whose length is filled in when it ends
+  struct Container {
+    std::size_t head_position;
+    std::uint64_t num_items;
+  };
+
+  void write_head(int major_type, std::uint64_t value);
+  void write_key(std::string_view key);
+  void write_text(std::string_view text);
+  void begin_container(int major_type);
+  void end_container(int major_type);
+
+  std::string buffer_;
+  std::vector<Container> containers_;
+};
+
+std::unique_ptr<RecordWriter> CreateRecordWriter(OutputType type);
+
+// Where finished records go
+class RecordSink {
+ public:
+  virtual ~RecordSink()                               = default;
+  virtual void write_record(std::string_view record) = 0;
+  // Called regularly, e.g. to send what couldn't be sent right away
+  virtual void poll() {}
+};
+
+// Writes records to stdout and flushes according to the configured policy, and
+// publishes them to any other sinks given with --sink. Records from several
+// threads may be written concurrently.
+//
+// With an output queue, records are written by a separate thread, so a slow
+// reader never holds up decoding; when the queue is full, records are dropped
+// or the caller waits, as configured. Queue statistics are printed to stderr
+// at the end.
+class Output : public RecordSink {
+ public:
+  explicit Output(const Options& options);
+  ~Output() override;
+  Output(const Output&)            = delete;
+  Output& operator=(const Output&) = delete;
+  void write_record(std::string_view record) override;
+  // Flush if the flush interval has passed; call this regularly
+  void poll() override;
+  void flush();
+
+ private:
+  void flush_buffer();
+  void publish(std::string_view record);
+  void enqueue(std::string_view record);
+  bool is_batch_ready() const;
+  void run_writer();
+
+  std::mutex mutex_;
+  FlushPolicy flush_policy_;
+  std::chrono::milliseconds flush_interval_;
+  std::size_t flush_size_;
+  std::string buffer_;
+  std::chrono::steady_clock::time_point last_flush_;
+  bool is_stdout_enabled_;
+  std::vector<std::unique_ptr<RecordSink>> sinks_;
+
+  // Only used with an output queue
+  std::size_t queue_capacity_;
+  QueueFullPolicy queue_full_policy_;
+  std::deque<std::string> queue_;
+  std::size_t num_queued_bytes_{};
+  std::condition_variable queue_changed_;
+  bool is_closing_{};
+  std::uint64_t num_dropped_{};
+  std::size_t max_queue_depth_{};
+  std::thread writer_;
+};
+
+}  // namespace darc2json
+#endif  // OUTPUT_H_
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#include "src/pipeline.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "src/layer1.h"
+#include "src/layer2.h"
+#include "src/layer3_4.h"
+#include "src/spsc_queue.h"
+#include "src/util.h"
+
+namespace darc2json {
+
+namespace {
+
+// About 4.6 seconds of MPX in chunks of 4096 samples
+constexpr std::size_t kSampleQueueSize = 256;
+constexpr std::size_t kBitQueueSize    = 256;
+constexpr std::size_t kRecordQueueSize = 4096;
+
+// Demodulated bits and the sample number at which each was received
+struct BitChunk {
+  SoftBits bits;
+  std::vector<std::uint64_t> sample_positions;
+};
+
+// Hands the records from Layer 3 over to the writer thread
+class QueueSink : public RecordSink {
+ public:
+  explicit QueueSink(SpscQueue<std::string>& queue) : queue_(queue) {}
+  void write_record(std::string_view record) override {
+    queue_.push(std::string(record));
+  }
+
+ private:
+  SpscQueue<std::string>& queue_;
+};
+
+template <typename T>
+void PrintQueueStats(const char* name, const SpscQueue<T>& queue) {
+  std::cerr << "pipeline: " << name << " queue: at most " << queue.high_water_mark() << " of "
+            << queue.capacity() << " queued, full " << queue.num_overflows() << " times" << '\n';
+}
+
+}  // namespace
+
+void RunPipeline(const Options& options, Output& output) {
+  Subcarrier subcarrier(options);
+  Layer2 layer2(options);
+
+  SpscQueue<std::vector<float>> sample_queue(kSampleQueueSize);
+  SpscQueue<BitChunk> bit_queue(kBitQueueSize);
+  SpscQueue<std::string> record_queue(kRecordQueueSize);
+
+  QueueSink record_sink(record_queue);
+  Layer3 layer3(options, record_sink);
+
+  std::string hex_record;
+  const L2BlockSink sink = [&](const L2Block& l2block) {
+    if (options.output_type == OutputType::Hex) {
+      hex_record.clear();
+      AppendL2BlockHex(hex_record, l2block);
+      record_sink.write_record(hex_record);
+    } else {
+      layer3.push_block(l2block);
+    }
+  };
+
+  std::thread reader([&subcarrier, &sample_queue] {
+    while (!subcarrier.input_eof()) sample_queue.push(subcarrier.ReadSamples());
+    sample_queue.close();
+  });
+
+  std::thread demodulator([&subcarrier, &sample_queue, &bit_queue] {
+    std::vector<float> samples;
+    while (sample_queue.pop(samples)) {
+      const SoftBits& bits = subcarrier.Demodulate(samples);
+      if (!bits.empty())
+        bit_queue.push({bits, subcarrier.bit_sample_positions()});
+    }
+    bit_queue.close();
+  });
+
+  std::thread decoder([&layer2, &sink, &bit_queue, &record_queue] {
+    BitChunk chunk;
+    while (bit_queue.pop(chunk))
+      layer2.PushBits(chunk.bits.data(), chunk.bits.size(), sink, chunk.sample_positions.data());
+    record_queue.close();
+  });
+
+  // The writer runs on this thread
+  std::string record;
+  while (record_queue.pop(record, [&output] { output.poll(); })) output.write_record(record);
+
+  reader.join();
+  demodulator.join();
+  decoder.join();
+
+  PrintQueueStats("sample", sample_queue);
+  PrintQueueStats("bit", bit_queue);
+  PrintQueueStats("record", record_queue);
+  if (options.bler)
+    PrintSlipCount(layer2.num_slips());
+}
+
+}  // namespace darc2json
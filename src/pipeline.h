@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include "src/common.h"
+#include "src/output.h"
+
+namespace darc2json {
+
+// Decode the MPX input in four stages on their own threads: reading,
+// demodulation, Layers 2-5, and writing the output. Stages are joined by
+// bounded queues, so a slow reader of our output doesn't hold up the
+// demodulator until the queues fill. Queue statistics are printed to stderr at
+// the end.
+void RunPipeline(const Options& options, Output& output);
+
+}  // namespace darc2json
+#endif  // PIPELINE_H_
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#include "src/sinks.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "src/archive.h"
+
+namespace darc2json {
+
+namespace {
+
+// Records queued for a slow subscriber before its records start to be dropped
+constexpr std::size_t kMaxPendingBytes = 1 << 20;
+constexpr std::size_t kShmRingCapacity = 1 << 22;
+constexpr int kListenBacklog           = 16;
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "shared memory positions must be lock-free");
+static_assert(sizeof(ShmRingHeader) <= 64, "ring header must fit in 64 bytes");
+
+#if defined(MSG_NOSIGNAL)
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+void SetNonBlocking(int fd) {
+  ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+#if defined(SO_NOSIGPIPE)
+  const int enable = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+#endif
+}
+
+std::runtime_error SystemError(const std::string& what) {
+  return std::runtime_error("error: " + what + ": " + std::strerror(errno));
+}
+
+// "[ADDRESS:]PORT", with 127.0.0.1 as the default address
+sockaddr_in ParseAddress(const std::string& spec) {
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+
+  const std::size_t colon = spec.rfind(':');
+  const std::string host  = (colon == std::string::npos ? "127.0.0.1" : spec.substr(0, colon));
+  const std::string port  = (colon == std::string::npos ? spec : spec.substr(colon + 1));
+  const int port_number   = std::atoi(port.c_str());
+  if (::inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1 || port_number < 1 ||
+      port_number > 65535)
+    throw std::runtime_error("error: invalid address '" + spec + "'");
+  address.sin_port = htons(static_cast<std::uint16_t>(port_number));
+
+  return address;
+}
+
+std::unique_ptr<RecordSink> CreateUnixServer(const std::string& path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path))
+    throw std::runtime_error("error: invalid socket path '" + path + "'");
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+  const int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    throw SystemError("socket");
+  ::unlink(path.c_str());
+  if (::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+      ::listen(fd, kListenBacklog) != 0) {
+    ::close(fd);
+    throw SystemError("can't listen on " + path);
+  }
+
+  return std::make_unique<SocketServerSink>(fd, path);
+}
+
+std::unique_ptr<RecordSink> CreateTcpServer(const std::string& spec) {
+  const sockaddr_in address = ParseAddress(spec);
+
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    throw SystemError("socket");
+  const int enable = 1;
+  ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if (::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+      ::listen(fd, kListenBacklog) != 0) {
+    ::close(fd);
+    throw SystemError("can't listen on " + spec);
+  }
+
+  return std::make_unique<SocketServerSink>(fd, "");
+}
+
+}  // namespace
+
+SocketServerSink::SocketServerSink(int listen_fd, std::string unix_path)
+    : listen_fd_(listen_fd), unix_path_(std::move(unix_path)) {
+  SetNonBlocking(listen_fd_);
+}
+
+SocketServerSink::~SocketServerSink() {
+  for (const Subscriber& subscriber : subscribers_) close_subscriber(subscriber);
+  ::close(listen_fd_);
+  if (!unix_path_.empty())
+    ::unlink(unix_path_.c_str());
+}
+
+void SocketServerSink::write_record(std::string_view record) {
+  accept_subscribers();
+
+  for (Subscriber& subscriber : subscribers_) {
+    if (subscriber.pending.size() + record.size() > kMaxPendingBytes)
+      subscriber.num_dropped++;
+    else
+      subscriber.pending.append(record);
+  }
+
+  poll();
+}
+
+// Send what can be sent without blocking, and forget subscribers that left
+void SocketServerSink::poll() {
+  for (auto subscriber = subscribers_.begin(); subscriber != subscribers_.end();) {
+    if (send_pending(*subscriber)) {
+      ++subscriber;
+    } else {
+      close_subscriber(*subscriber);
+      subscriber = subscribers_.erase(subscriber);
+    }
+  }
+}
+
+void SocketServerSink::accept_subscribers() {
+  int fd;
+  while ((fd = ::accept(listen_fd_, nullptr, nullptr)) >= 0) {
+    SetNonBlocking(fd);
+    subscribers_.push_back({fd, "", 0});
+  }
+}
+
+// Returns false if the subscriber is gone
+bool SocketServerSink::send_pending(Subscriber& subscriber) {
+  std::size_t num_sent = 0;
+  while (num_sent < subscriber.pending.size()) {
+    const ssize_t result = ::send(subscriber.fd, subscriber.pending.data() + num_sent,
+                                  subscriber.pending.size() - num_sent, kSendFlags);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return false;
+    }
+    num_sent += result;
+  }
+  subscriber.pending.erase(0, num_sent);
+  return true;
+}
+
+void SocketServerSink::close_subscriber(const Subscriber& subscriber) {
+  if (subscriber.num_dropped > 0)
+    std::cerr << "sink: dropped " << subscriber.num_dropped << " records for a slow subscriber"
+              << '\n';
+  ::close(subscriber.fd);
+}
+
+UdpSink::UdpSink(const sockaddr_in& address)
+    : fd_(::socket(AF_INET, SOCK_DGRAM, 0)), address_(address) {
+  if (fd_ < 0)
+    throw SystemError("socket");
+  SetNonBlocking(fd_);
+}
+
+UdpSink::~UdpSink() {
+  ::close(fd_);
+}
+
+void UdpSink::write_record(std::string_view record) {
+  ::sendto(fd_, record.data(), record.size(), kSendFlags,
+           reinterpret_cast<const sockaddr*>(&address_), sizeof(address_));
+}
+
+ShmRingSink::ShmRingSink(const std::string& name, std::size_t capacity)
+    : name_(name), mapping_size_(64 + capacity) {
+  const int fd = ::shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0)
+    throw SystemError("can't open shared memory " + name);
+  if (::ftruncate(fd, mapping_size_) != 0) {
+    ::close(fd);
+    throw SystemError("can't size shared memory " + name);
+  }
+  mapping_ = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapping_ == MAP_FAILED)
+    throw SystemError("can't map shared memory " + name);
+
+  // Readers that see a position from an earlier run would misread the
+  // records, so the whole area starts out empty
+  std::memset(mapping_, 0, mapping_size_);
+  header_ = new (mapping_)
+      ShmRingHeader{{'d', 'a', 'r', 'c', 'r', 'i', 'n', 'g'}, 2, 64, capacity, {0}, {0}};
+  records_ = static_cast<std::uint8_t*>(mapping_) + 64;
+}
+
+ShmRingSink::~ShmRingSink() {
+  ::munmap(mapping_, mapping_size_);
+  ::shm_unlink(name_.c_str());
+}
+
+void ShmRingSink::write_record(std::string_view record) {
+  const std::uint64_t capacity = header_->capacity;
+  const std::uint64_t size     = (8 + record.size() + 7) / 8 * 8;
+  if (size > capacity / 2)
+    return;
+
+  std::uint64_t offset    = write_position_ % capacity;
+  const bool is_wrapping  = (offset + size > capacity);
+  const std::uint64_t end = write_position_ + (is_wrapping ? capacity - offset : 0) + size;
+
+  // Readers must see the range as claimed before any of its old bytes change
+  header_->reserve_position.store(end, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  if (is_wrapping) {
+    const std::uint32_t marker = kShmRingWrapMarker;
+    std::memcpy(records_ + offset, &marker, sizeof(marker));
+    offset = 0;
+  }
+
+  const auto length = static_cast<std::uint32_t>(record.size());
+  std::memcpy(records_ + offset, &length, sizeof(length));
+  std::memset(records_ + offset + 4, 0, 4);
+  std::memcpy(records_ + offset + 8, record.data(), record.size());
+  write_position_ = end;
+
+  header_->write_position.store(write_position_, std::memory_order_release);
+}
+
+std::unique_ptr<RecordSink> CreateSink(const std::string& spec, const Options& options) {
+  const std::size_t colon = spec.find(':');
+  const std::string type  = spec.substr(0, colon);
+  const std::string rest  = (colon == std::string::npos ? "" : spec.substr(colon + 1));
+
+  if (type == "unix")
+    return CreateUnixServer(rest);
+  if (type == "tcp")
+    return CreateTcpServer(rest);
+  if (type == "udp")
+    return std::make_unique<UdpSink>(ParseAddress(rest));
+  if (type == "shm" && !rest.empty())
+    return std::make_unique<ShmRingSink>(rest, kShmRingCapacity);
+  if (type == "gzip" && !rest.empty())
+    return std::make_unique<ArchiveSink>(rest, options.rotate_size,
+                                         std::chrono::seconds(options.rotate_interval_s));
+
+  throw std::runtime_error("error: unknown output sink '" + spec + "'");
+}
+
+}  // namespace darc2json
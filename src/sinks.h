@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#ifndef SINKS_H_
+#define SINKS_H_
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "src/output.h"
+
+namespace darc2json {
+
+// Accepts any number of subscribers on a listening stream socket (Unix domain
+// or TCP) and sends every record to all of them. Sockets are non-blocking: a
+// subscriber that doesn't keep up has records queued for it, up to a limit,
+// after which its records are dropped. Other subscribers are not affected.
+class SocketServerSink : public RecordSink {
+ public:
+  // Takes ownership of a bound socket; `unix_path` is removed on destruction
+  SocketServerSink(int listen_fd, std::string unix_path);
+  ~SocketServerSink() override;
+  SocketServerSink(const SocketServerSink&)            = delete;
+  SocketServerSink& operator=(const SocketServerSink&) = delete;
+  void write_record(std::string_view record) override;
+  void poll() override;
+
+ private:
+  struct Subscriber {
+    int fd;
+    std::string pending;
+    std::uint64_t num_dropped;
+  };
+
+  void accept_subscribers();
+  bool send_pending(Subscriber& subscriber);
+  void close_subscriber(const Subscriber& subscriber);
+
+  int listen_fd_;
+  std::string unix_path_;
+  std::vector<Subscriber> subscribers_;
+};
+
+// Sends every record as one UDP datagram. Records that can't be sent right
+// away are dropped.
+class UdpSink : public RecordSink {
+ public:
+  explicit UdpSink(const sockaddr_in& address);
+  ~UdpSink() override;
+  UdpSink(const UdpSink&)            = delete;
+  UdpSink& operator=(const UdpSink&) = delete;
+  void write_record(std::string_view record) override;
+
+ private:
+  int fd_;
+  sockaddr_in address_;
+};
+
+// Publishes records into a ring buffer in POSIX shared memory. Local
+// consumers map it read-only and read records in place, each at its own pace;
+// the writer never waits for them.
+//
+// The mapping starts with a 64-byte ShmRingHeader, followed by `capacity`
+// bytes of records. Positions count bytes written since the start and only
+// grow; position p is at offset p % capacity of the record area. Each record
+// is a uint32 length and 4 reserved bytes, then the record, padded to a
+// multiple of 8 bytes. A length of kShmRingWrapMarker means the rest of the
+// area is unused and the next record is at the start.
+//
+// Before touching the record area, the writer advances reserve_position to the
+// end of what it is about to write; once done, it stores the same value to
+// write_position (release). To read, load write_position (acquire) and read
+// records up to it. After copying or using a record, issue an acquire fence
+// and check that reserve_position has not moved more than `capacity` past the
+// record's start; if it has, the record may have been overwritten and the
+// reader has fallen behind.
+struct ShmRingHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t header_size;
+  std::uint64_t capacity;
+  std::atomic<std::uint64_t> write_position;
+  std::atomic<std::uint64_t> reserve_position;
+};
+
+constexpr std::uint32_t kShmRingWrapMarker = 0xFFFFFFFF;
+
+class ShmRingSink : public RecordSink {
+ public:
+  ShmRingSink(const std::string& name, std::size_t capacity);
+  ~ShmRingSink() override;
+  ShmRingSink(const ShmRingSink&)            = delete;
+  ShmRingSink& operator=(const ShmRingSink&) = delete;
+  void write_record(std::string_view record) override;
+
+ private:
+  std::string name_;
+  std::size_t mapping_size_;
+  void* mapping_;
+  ShmRingHeader* header_;
+  std::uint8_t* records_;
+  std::uint64_t write_position_{};
+};
+
+// Parse a sink specification:
+//   unix:PATH             Unix domain socket server
+//   tcp:[ADDRESS:]PORT    TCP server, on 127.0.0.1 by default
+//   udp:[ADDRESS:]PORT    UDP datagrams, to 127.0.0.1 by default
+//   shm:NAME              Shared memory ring buffer, e.g. shm:/darc2json
+//   gzip:PREFIX           Compressed archive files, rotated as set in options
+// Throws std::runtime_error if the sink can't be set up.
+std::unique_ptr<RecordSink> CreateSink(const std::string& spec, const Options& options);
+
+}  // namespace darc2json
+#endif  // SINKS_H_
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#ifndef SPSC_QUEUE_H_
+#define SPSC_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace darc2json {
+
+// Bounded lock-free queue between exactly one producer thread and one
+// consumer thread. A full queue makes the producer wait; it is counted as an
+// overflow, along with the highest number of items ever queued.
+template <typename T>
+class SpscQueue {
+ public:
+  // Capacity is rounded up to a power of two
+  explicit SpscQueue(std::size_t capacity) : slots_(RoundUpToPowerOfTwo(capacity)) {}
+  SpscQueue(const SpscQueue&)            = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  // Producer side
+  void push(T item) {
+    if (!try_push(item)) {
+      num_overflows_.fetch_add(1, std::memory_order_relaxed);
+      for (int n_try = 0; !try_push(item); n_try++) Wait(n_try);
+    }
+  }
+
+  // Producer side: no more items will be pushed
+  void close() {
+    is_closed_.store(true, std::memory_order_release);
+  }
+
+  // Consumer side. Waits for an item, calling on_idle() while there is none;
+  // returns false once the queue is closed and empty.
+  template <typename OnIdle>
+  bool pop(T& item, const OnIdle& on_idle) {
+    for (int n_try = 0;; n_try++) {
+      const bool was_closed = is_closed_.load(std::memory_order_acquire);
+      if (try_pop(item))
+        return true;
+      if (was_closed)
+        return false;
+      on_idle();
+      Wait(n_try);
+    }
+  }
+
+  bool pop(T& item) {
+    return pop(item, [] {});
+  }
+
+  std::size_t capacity() const {
+    return slots_.size();
+  }
+
+  std::size_t high_water_mark() const {
+    return high_water_mark_.load(std::memory_order_relaxed);
+  }
+
+  std::size_t num_overflows() const {
+    return num_overflows_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static std::size_t RoundUpToPowerOfTwo(std::size_t n) {
+    std::size_t power = 1;
+    while (power < n) power <<= 1;
+    return power;
+  }
+
+  // Spin briefly, then yield, then sleep so an idle stage doesn't burn a core
+  static void Wait(int n_try) {
+    if (n_try < 64)
+      return;
+    if (n_try < 128)
+      std::this_thread::yield();
+    else
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+
+  bool try_push(T& item) {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    const std::size_t size = tail - head_.load(std::memory_order_acquire);
+    if (size == slots_.size())
+      return false;
+
+    slots_[tail & (slots_.size() - 1)] = std::move(item);
+    tail_.store(tail + 1, std::memory_order_release);
+
+    if (size + 1 > high_water_mark_.load(std::memory_order_relaxed))
+      high_water_mark_.store(size + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool try_pop(T& item) {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return false;
+
+    item = std::move(slots_[head & (slots_.size() - 1)]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  std::vector<T> slots_;
+  // Indices only ever grow; each is written by one side and kept on its own
+  // cache line
+  alignas(64) std::atomic<std::size_t> head_{};
+  alignas(64) std::atomic<std::size_t> tail_{};
+  std::atomic<std::size_t> high_water_mark_{};
+  std::atomic<std::size_t> num_overflows_{};
+  std::atomic<bool> is_closed_{};
+};
+
+}  // namespace darc2json
+#endif  // SPSC_QUEUE_H_
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#include "src/streams.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "src/input.h"
+
+namespace darc2json {
+
+namespace {
+
+// Consecutive blocks start this far apart: a 16-bit BIC and the 272-bit block
+constexpr double kBlockPeriod_samples = (16 + 272) * kSamplesPerBit;
+
+// Each segment starts this much early to let the AGC, filters and sync settle,
+// and runs on long enough to complete the blocks that started inside it
+constexpr double kSegmentWarmup_s = 2.0;
+constexpr double kSegmentTail_s   = 0.5;
+// Shorter segments would spend too much of their time warming up
+constexpr double kMinSegmentLength_s = 60.0;
+// Segments per thread, to even out the load
+constexpr int kSegmentsPerThread = 4;
+
+// FIFOs and devices are read as raw MPX; libsndfile would need to seek
+bool IsUnseekable(const std::string& filename) {
+  struct stat info;
+  return ::stat(filename.c_str(), &info) == 0 && (S_ISFIFO(info.st_mode) || S_ISCHR(info.st_mode));
+}
+
+}  // namespace
+
+WorkStealingPool::WorkStealingPool(int num_threads)
+    : num_threads_(std::max(num_threads, 1)), queues_(num_threads_) {}
+
+void WorkStealingPool::run(std::vector<Task> tasks) {
+  tasks_          = std::move(tasks);
+  num_queued_     = 0;
+  num_unfinished_ = tasks_.size();
+  for (std::size_t n_task = 0; n_task < tasks_.size(); n_task++)
+    push_task(n_task % num_threads_, n_task);
+
+  std::vector<std::thread> threads;
+  for (std::size_t n_worker = 0; n_worker < num_threads_; n_worker++)
+    threads.emplace_back(&WorkStealingPool::work, this, n_worker);
+  for (std::thread& thread : threads) thread.join();
+
+  tasks_.clear();
+}
+
+void WorkStealingPool::work(std::size_t n_worker) {
+  while (true) {
+    std::size_t n_task;
+    if (pop_task(n_worker, n_task)) {
+      if (tasks_[n_task]()) {
+        push_task(n_worker, n_task);
+      } else if (--num_unfinished_ == 0) {
+        const std::lock_guard<std::mutex> lock(idle_mutex_);
+        idle_.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(idle_mutex_);
+    idle_.wait(lock, [this] { return num_queued_ > 0 || num_unfinished_ == 0; });
+    if (num_unfinished_ == 0)
+      return;
+  }
+}
+
+// Take the newest task from our own queue, which is likely still in this
+// core's cache, or else the oldest task from another thread's queue
+bool WorkStealingPool::pop_task(std::size_t n_worker, std::size_t& n_task) {
+  for (std::size_t n = 0; n < num_threads_; n++) {
+    WorkQueue& queue = queues_[(n_worker + n) % num_threads_];
+    const std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.task_indices.empty()) {
+      if (n == 0) {
+        n_task = queue.task_indices.back();
+        queue.task_indices.pop_back();
+      } else {
+        n_task = queue.task_indices.front();
+        queue.task_indices.pop_front();
+      }
+      num_queued_--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::push_task(std::size_t n_worker, std::size_t n_task) {
+  {
+    const std::lock_guard<std::mutex> lock(queues_[n_worker].mutex);
+    queues_[n_worker].task_indices.push_back(n_task);
+  }
+  {
+    const std::lock_guard<std::mutex> lock(idle_mutex_);
+    num_queued_++;
+  }
+  idle_.notify_one();
+}
+
+StreamDecoder::StreamDecoder(const Options& options, Output& output)
+    : output_(output),
+      subcarrier_(options),
+      layer2_(options),
+      layer3_(options, output),
+      sink_([this](const L2Block& l2block) { layer3_.push_block(l2block); }) {}
+
+bool StreamDecoder::decode_chunk() {
+  if (subcarrier_.eof())
+    return false;
+
+  const SoftBits& bits = subcarrier_.ReadBits();
+  layer2_.PushBits(bits.data(), bits.size(), sink_, subcarrier_.bit_sample_positions().data());
+  output_.poll();
+
+  return !subcarrier_.eof();
+}
+
+int StreamDecoder::num_slips() const {
+  return layer2_.num_slips();
+}
+
+SegmentDecoder::SegmentDecoder(const Options& options, double keep_from)
+    : subcarrier_(options),
+      layer2_(options),
+      first_sample_position_(options.input_start_sample * kTargetSampleRate_Hz /
+                             subcarrier_.input_samplerate()),
+      keep_from_(keep_from) {
+  sink_ = [this](const L2Block& l2block) {
+    const double sample_position = first_sample_position_ + l2block.sample_position();
+    if (sample_position < keep_from_)
+      return;
+
+    DecodedBlock block{sample_position, static_cast<eBic>(l2block.BicNum() - 1),
+                       l2block.is_corrected(), {}};
+    const ByteView info_bytes = l2block.information_bytes();
+    std::copy(info_bytes.begin(), info_bytes.end(), block.information_bytes.begin());
+    blocks_.push_back(block);
+  };
+}
+
+bool SegmentDecoder::decode_chunk() {
+  if (subcarrier_.eof())
+    return false;
+
+  const SoftBits& bits = subcarrier_.ReadBits();
+  layer2_.PushBits(bits.data(), bits.size(), sink_, subcarrier_.bit_sample_positions().data());
+
+  return !subcarrier_.eof();
+}
+
+const std::vector<SegmentDecoder::DecodedBlock>& SegmentDecoder::blocks() const {
+  return blocks_;
+}
+
+void DecodeSegments(const Options& options, Output& output) {
+  const SndfileReader file(options);
+  const std::int64_t num_samples = file.num_frames();
+  const float samplerate         = file.samplerate();
+
+  const int num_threads = options.num_threads > 0
+                              ? options.num_threads
+                              : std::max<int>(std::thread::hardware_concurrency(), 1);
+  const std::int64_t min_length = kMinSegmentLength_s * samplerate;
+  const std::int64_t num_segments =
+      std::max<std::int64_t>(1, std::min<std::int64_t>(num_threads * kSegmentsPerThread,
+                                                       num_samples / min_length));
+  const auto warmup = static_cast<std::int64_t>(kSegmentWarmup_s * samplerate);
+  const auto tail   = static_cast<std::int64_t>(kSegmentTail_s * samplerate);
+
+  std::vector<std::unique_ptr<SegmentDecoder>> decoders;
+  for (std::int64_t n_segment = 0; n_segment < num_segments; n_segment++) {
+    const std::int64_t start = num_samples * n_segment / num_segments;
+    const std::int64_t end   = num_samples * (n_segment + 1) / num_segments;
+
+    Options segment_options            = options;
+    segment_options.feed_thru          = false;
+    segment_options.input_start_sample = std::max<std::int64_t>(start - warmup, 0);
+    segment_options.input_num_samples =
+        std::min(end + tail, num_samples) - segment_options.input_start_sample;
+
+    const double keep_from = (n_segment == 0 ? 0.0 : start * kTargetSampleRate_Hz / samplerate);
+    decoders.push_back(std::make_unique<SegmentDecoder>(segment_options, keep_from));
+  }
+
+  std::vector<WorkStealingPool::Task> tasks;
+  for (const std::unique_ptr<SegmentDecoder>& decoder : decoders)
+    tasks.push_back([&decoder] { return decoder->decode_chunk(); });
+
+  WorkStealingPool pool(num_threads);
+  pool.run(std::move(tasks));
+
+  // Where segments overlap, the same block is found twice; the copy from the
+  // later segment starts at about the same sample as one already passed on
+  Layer3 layer3(options, output);
+  L2Block l2block(BIC1);
+  double last_sample_position = -kBlockPeriod_samples;
+  for (const std::unique_ptr<SegmentDecoder>& decoder : decoders) {
+    for (const SegmentDecoder::DecodedBlock& block : decoder->blocks()) {
+      if (block.sample_position < last_sample_position + kBlockPeriod_samples / 2)
+        continue;
+      last_sample_position = block.sample_position;
+
+      l2block.Restore(block.bic, std::llround(block.sample_position / kSamplesPerBit),
+                      block.is_corrected,
+                      ByteView(block.information_bytes.data(), block.information_bytes.size()));
+      l2block.set_sample_position(std::llround(block.sample_position));
+      layer3.push_block(l2block);
+    }
+    output.poll();
+  }
+}
+
+// Every input is opened here, before the pool starts, so that one that can't be
+// opened throws on the calling thread and no stream has been decoded yet
+void DecodeStreams(const Options& options, Output& output) {
+  std::vector<std::unique_ptr<StreamDecoder>> decoders;
+  for (std::size_t n_stream = 0; n_stream < options.stream_filenames.size(); n_stream++) {
+    const std::string& filename = options.stream_filenames[n_stream];
+
+    Options stream_options   = options;
+    stream_options.stream_id = static_cast<int>(n_stream);
+    stream_options.feed_thru = false;
+    if (filename == "-") {
+      stream_options.input_type = InputType::MpxStdin;
+    } else {
+      stream_options.input_type =
+          IsUnseekable(filename) ? InputType::MpxRawFile : InputType::MpxSndfile;
+      stream_options.sndfilename = filename;
+    }
+
+    decoders.push_back(std::make_unique<StreamDecoder>(stream_options, output));
+  }
+
+  const int num_threads =
+      options.num_threads > 0 ? options.num_threads
+                              : std::min<int>(std::thread::hardware_concurrency(), decoders.size());
+
+  std::vector<WorkStealingPool::Task> tasks;
+  for (const std::unique_ptr<StreamDecoder>& decoder : decoders)
+    tasks.push_back([&decoder] { return decoder->decode_chunk(); });
+
+  WorkStealingPool pool(num_threads);
+  pool.run(std::move(tasks));
+
+  if (options.bler) {
+    int num_slips = 0;
+    for (const std::unique_ptr<StreamDecoder>& decoder : decoders)
+      num_slips += decoder->num_slips();
+    PrintSlipCount(num_slips);
+  }
+}
+
+}  // namespace darc2json
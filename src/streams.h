@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) Oona Räisänen
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+#ifndef STREAMS_H_
+#define STREAMS_H_
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "src/common.h"
+#include "src/layer1.h"
+#include "src/layer2.h"
+#include "src/layer3_4.h"
+#include "src/output.h"
+
+namespace darc2json {
+
+// A fixed set of threads running tasks that are resumed over and over until
+// they finish. Each thread has its own queue and prefers the task it ran last;
+// a thread that runs out of work steals from the other queues. A task is in at
+// most one queue at a time, so it never runs on two threads at once.
+class WorkStealingPool {
+ public:
+  // Does one piece of work; returns false once there is nothing left to do
+  using Task = std::function<bool()>;
+
+  explicit WorkStealingPool(int num_threads);
+  ~WorkStealingPool() = default;
+  // Returns when every task has finished
+  void run(std::vector<Task> tasks);
+
+ private:
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<std::size_t> task_indices;
+  };
+
+  void work(std::size_t n_worker);
+  bool pop_task(std::size_t n_worker, std::size_t& n_task);
+  void push_task(std::size_t n_worker, std::size_t n_task);
+
+  std::size_t num_threads_;
+  std::vector<Task> tasks_;
+  std::vector<WorkQueue> queues_;
+
+  // Idle threads sleep until a task is queued or all are finished
+  std::mutex idle_mutex_;
+  std::condition_variable idle_;
+  // May go briefly negative while a task is being queued
+  std::atomic<int> num_queued_{};
+  std::atomic<std::size_t> num_unfinished_{};
+};
+
+// The full decoder chain of one input
+class StreamDecoder {
+ public:
+  StreamDecoder(const Options& options, Output& output);
+  // Demodulate and decode the next chunk of input. Returns false at the end of
+  // the input.
+  bool decode_chunk();
+  int num_slips() const;
+
+ private:
+  Output& output_;
+  Subcarrier subcarrier_;
+  Layer2 layer2_;
+  Layer3 layer3_;
+  L2BlockSink sink_;
+};
+
+// Layers 1 and 2 for one time segment of an audio file. Blocks are kept with
+// their sample position, to be merged with the other segments and passed to a
+// single Layer 3 in order.
+class SegmentDecoder {
+ public:
+  struct DecodedBlock {
+    // Where the block ends, at the target sample rate, counted from the start
+    // of the file
+    double sample_position;
+    eBic bic;
+    bool is_corrected;
+    std::array<std::uint8_t, 176 / 8> information_bytes;
+  };
+
+  // Blocks ending before `keep_from` (at the target sample rate) are only
+  // decoded to let the demodulator settle, and are not kept
+  SegmentDecoder(const Options& options, double keep_from);
+  bool decode_chunk();
+  const std::vector<DecodedBlock>& blocks() const;
+
+ private:
+  Subcarrier subcarrier_;
+  Layer2 layer2_;
+  L2BlockSink sink_;
+  double first_sample_position_;
+  double keep_from_;
+  std::vector<DecodedBlock> blocks_;
+};
+
+// Decode options.sndfilename in overlapping segments on a thread pool
+void DecodeSegments(const Options& options, Output& output);
+
+// Decode every file in options.stream_filenames on a shared thread pool, each
+// record tagged with the index of its stream
+void DecodeStreams(const Options& options, Output& output);
+
+}  // namespace darc2json
+#endif  // STREAMS_H_
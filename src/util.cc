@@ -17,12 +17,16 @@
 #include "src/util.h"
 
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <ctime>
 #include <initializer_list>
 #include <iomanip>
 #include <map>
 #include <sstream>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace darc2json {
@@ -74,6 +78,20 @@ std::uint32_t field(const Bits& bits, int start_at, int length) {
   return result;
 }
 
+// Same as field(), for bits packed LSB-first into bytes
+std::uint32_t packed_field(ByteView bytes, int start_at, int length) {
+  assert(length <= 32);
+  assert(start_at >= 0);
+  assert(static_cast<std::size_t>(start_at + length) <= bytes.size() * 8);
+  std::uint32_t result = 0;
+  for (int i = 0; i < length; i++) {
+    const int n_bit = start_at + i;
+    result += ((bytes[n_bit / 8] >> (n_bit % 8)) & 1U) << i;
+  }
+
+  return result;
+}
+
 std::uint32_t field_rev(const Bits& bits, int start_at, int length) {
   assert(length <= 32);
   assert(start_at + length <= static_cast<int>(bits.size()));
@@ -126,6 +144,26 @@ bool check_crc(const Bits& bits, const Bits& generator, std::size_t message_leng
   return AllBitsZero(crc(bits, generator, message_length));
 }
 
+// Check the CRC over bits packed into bytes, without unpacking them
+bool check_crc(ByteView bytes, BitOrder order, CrcPolynomial generator,
+               std::size_t message_length) {
+  assert(generator.degree > 0 && generator.degree <= 32);
+  assert(message_length <= bytes.size() * 8);
+  const int degree         = generator.degree;
+  const std::uint64_t mask = (1ULL << degree) - 1;
+
+  std::uint64_t result = 0;
+  for (std::size_t n_bit = 0; n_bit < message_length; n_bit++) {
+    const int shift      = (order == BitOrder::LsbFirst ? n_bit % 8 : 7 - n_bit % 8);
+    const int popped_bit = (result >> (degree - 1)) & 1;
+    result               = ((result << 1) | ((bytes[n_bit / 8] >> shift) & 1)) & mask;
+    if (popped_bit)
+      result ^= generator.taps;
+  }
+
+  return result == 0;
+}
+
 bool BitsEqual(const Bits& bits1, const Bits& bits2) {
   bool match = true;
 
@@ -165,16 +203,33 @@ const std::map<Bits, Bits> create_bitflip_syndrome_map(std::size_t len, const Bi
 }
 
 // Bytes to hex string (01 2c 52 00 ...)
-std::string BytesToHexString(const std::vector<uint8_t>& data) {
-  std::stringstream ss;
-  for (std::size_t n_byte = 0; n_byte < data.size(); n_byte++) {
-    ss << std::setfill('0') << std::setw(2) << std::hex << static_cast<int>(data[n_byte]);
+std::string BytesToHexString(ByteView data) {
+  std::string result;
+  AppendHexString(result, data);
+  return result;
+}
 
-    if (n_byte < data.size() - 1)
-      ss << " ";
+void AppendHexString(std::string& out, ByteView data) {
+  constexpr char kHexDigits[] = "0123456789abcdef";
+  if (data.empty())
+    return;
+
+  const std::size_t start = out.size();
+  out.resize(start + data.size() * 3 - 1, ' ');
+  char* hex = &out[start];
+  for (std::size_t n_byte = 0; n_byte < data.size(); n_byte++) {
+    hex[3 * n_byte]     = kHexDigits[data[n_byte] >> 4];
+    hex[3 * n_byte + 1] = kHexDigits[data[n_byte] & 0xF];
   }
+}
 
-  return ss.str();
+std::uint64_t HashBytes(ByteView bytes, std::uint64_t hash) {
+  constexpr std::uint64_t kFnvPrime = 0x100000001b3;
+  for (const std::uint8_t byte : bytes) {
+    hash ^= byte;
+    hash *= kFnvPrime;
+  }
+  return hash;
 }
 
 std::string BitsToHexString(const Bits& data) {
@@ -219,8 +274,8 @@ std::vector<std::uint8_t> bit_vector_to_reversed_bytes(const Bits& bits) {
 // Extract a field from a vector of bytes.
 // The bit numbering in a byte corresponds to that used in the DARC
 // specification.
-std::uint32_t bfield(const std::vector<std::uint8_t>& bytes, std::size_t start_byte,
-                     std::size_t start_bit, std::size_t length) {
+std::uint32_t bfield(ByteView bytes, std::size_t start_byte, std::size_t start_bit,
+                     std::size_t length) {
   assert(start_byte < bytes.size());
   assert(length <= bytes.size() * 8);
   std::uint32_t result = 0;
@@ -238,4 +293,24 @@ std::uint32_t bfield(const std::vector<std::uint8_t>& bytes, std::size_t start_b
   return result;
 }
 
+TimestampFormatter::TimestampFormatter(std::string format) : format_(std::move(format)) {}
+
+const std::string& TimestampFormatter::format(std::chrono::system_clock::time_point time) {
+  const std::time_t seconds = std::chrono::system_clock::to_time_t(time);
+  if (has_formatted_ && seconds == formatted_time_)
+    return formatted_;
+
+  std::tm tm{};
+  ::localtime_r(&seconds, &tm);
+  char buffer[64];
+  if (std::strftime(buffer, sizeof(buffer), format_.c_str(), &tm) > 0)
+    formatted_ = buffer;
+  else
+    formatted_ = "(format error)";
+
+  formatted_time_ = seconds;
+  has_formatted_  = true;
+  return formatted_;
+}
+
 }  // namespace darc2json
@@ -17,8 +17,11 @@
 #ifndef UTIL_H_
 #define UTIL_H_
 
+#include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <ctime>
 #include <initializer_list>
 #include <map>
 #include <string>
@@ -29,11 +32,109 @@ namespace darc2json {
 using Bits  = std::vector<std::uint8_t>;
 using Bytes = std::vector<std::uint8_t>;
 
+// A soft-decision bit: the sign is the bit value (positive = 1) and the
+// magnitude its reliability. kSoftBitMax is a hard decision.
+using SoftBit  = std::int8_t;
+using SoftBits = std::vector<SoftBit>;
+
+constexpr SoftBit kSoftBitMax = 127;
+
+// Non-owning view of a sequence of bytes
+class ByteView {
+ public:
+  constexpr ByteView() = default;
+  constexpr ByteView(const std::uint8_t* data, std::size_t size) : data_(data), size_(size) {}
+  ByteView(const std::vector<std::uint8_t>& bytes) : data_(bytes.data()), size_(bytes.size()) {}
+
+  constexpr const std::uint8_t* data() const {
+    return data_;
+  }
+  constexpr std::size_t size() const {
+    return size_;
+  }
+  constexpr bool empty() const {
+    return size_ == 0;
+  }
+  constexpr const std::uint8_t* begin() const {
+    return data_;
+  }
+  constexpr const std::uint8_t* end() const {
+    return data_ + size_;
+  }
+  constexpr std::uint8_t operator[](std::size_t n) const {
+    return data_[n];
+  }
+  constexpr ByteView subview(std::size_t offset, std::size_t length) const {
+    return ByteView(data_ + offset, length);
+  }
+
+ private:
+  const std::uint8_t* data_{};
+  std::size_t size_{};
+};
+
+// Order in which the bits of a byte are read
+enum class BitOrder { LsbFirst, MsbFirst };
+
+// A bit field at a position fixed at compile time, read from packed bytes with
+// shifts and masks. With LsbFirst, kStart counts from bit 0 of the first byte
+// and the first bit is the least significant in the result, like
+// packed_field(). With MsbFirst, kStart counts from bit 7 and the first bit is
+// the most significant, like bfield().
+template <BitOrder kOrder, std::size_t kStart, std::size_t kLength>
+struct BitField {
+  static_assert(kLength >= 1 && kStart % 8 + kLength <= 32, "field must fit in 4 bytes");
+
+  static constexpr std::size_t kFirstByte = kStart / 8;
+  static constexpr std::size_t kNumBytes  = (kStart % 8 + kLength + 7) / 8;
+  static constexpr std::uint32_t kMask    = (std::uint64_t{1} << kLength) - 1;
+
+  static constexpr std::uint32_t Read(ByteView bytes) {
+    assert(bytes.size() >= kFirstByte + kNumBytes);
+    std::uint32_t word = 0;
+    if constexpr (kOrder == BitOrder::LsbFirst) {
+      for (std::size_t i = 0; i < kNumBytes; i++)
+        word |= std::uint32_t{bytes[kFirstByte + i]} << (8 * i);
+      return (word >> (kStart % 8)) & kMask;
+    } else {
+      for (std::size_t i = 0; i < kNumBytes; i++) word = (word << 8) | bytes[kFirstByte + i];
+      return (word >> (kNumBytes * 8 - kStart % 8 - kLength)) & kMask;
+    }
+  }
+
+  // Set the field to zero in bytes that are large enough to hold it
+  static constexpr void Clear(std::uint8_t* bytes) {
+    for (std::size_t bit = kStart; bit < kStart + kLength; bit++) {
+      if constexpr (kOrder == BitOrder::LsbFirst)
+        bytes[bit / 8] &= ~(1u << (bit % 8));
+      else
+        bytes[bit / 8] &= ~(0x80u >> (bit % 8));
+    }
+  }
+};
+
+// CRC generator polynomial of degree 32 at most. Bit k of `taps` is the
+// coefficient of x^k; the x^degree term is implied.
+struct CrcPolynomial {
+  int degree;
+  std::uint32_t taps;
+};
+
+// Nonzero coefficients, highest first: x^6 + x^4 + x^3 + 1 is {6, 4, 3, 0}
+constexpr CrcPolynomial CrcPolynomialFromCoeffs(std::initializer_list<int> coeffs) {
+  CrcPolynomial poly{*coeffs.begin(), 0};
+  for (const int c : coeffs)
+    if (c < poly.degree)
+      poly.taps |= std::uint32_t{1} << c;
+  return poly;
+}
+
 Bits poly_coeffs_to_bits(const std::initializer_list<int>& coeffs);
 Bits bitvector_lsb(const std::vector<std::uint8_t>& input);
 Bits bitvector_msb(const std::vector<std::uint8_t>& input);
 std::uint32_t field(const Bits& bits, int start_at, int length);
 std::uint32_t field_rev(const Bits& bits, int start_at, int length);
+std::uint32_t packed_field(ByteView bytes, int start_at, int length);
 void lshift(Bits& bits);
 // Bits crc(Bits bits, const Bits& generator);
 bool BitsEqual(const Bits& bits1, const Bits& bits2);
@@ -41,18 +142,40 @@ std::string BitString(const Bits& bits);
 Bits crc(const Bits& bits, const Bits& generator, std::size_t message_length);
 
 bool check_crc(const Bits& bits, const Bits& generator, std::size_t message_length);
+bool check_crc(ByteView bytes, BitOrder order, CrcPolynomial generator, std::size_t message_length);
 
 const std::map<Bits, Bits> create_bitflip_syndrome_map(std::size_t len, const Bits& generator);
 std::string BitsToHexString(const Bits& data);
-std::string BytesToHexString(const std::vector<std::uint8_t>& data);
+std::string BytesToHexString(ByteView data);
+void AppendHexString(std::string& out, ByteView data);
+
+// 64-bit FNV-1a; pass a previous result as `hash` to continue hashing
+constexpr std::uint64_t kFnvOffsetBasis = 0xcbf29ce484222325;
+std::uint64_t HashBytes(ByteView bytes, std::uint64_t hash = kFnvOffsetBasis);
 
 bool AllBitsZero(const Bits& bits);
 
 Bits reversed_bytes_to_bit_vector(const std::vector<std::uint8_t>& bytes);
 std::vector<std::uint8_t> bit_vector_to_reversed_bytes(const Bits& bits);
 
-std::uint32_t bfield(const std::vector<std::uint8_t>& bytes, std::size_t start_byte,
-                     std::size_t start_bit, std::size_t length);
+std::uint32_t bfield(ByteView bytes, std::size_t start_byte, std::size_t start_bit,
+                     std::size_t length);
+
+// Formats times in local time with a strftime format. Its fields are whole
+// seconds at the finest, so the string is only rebuilt when the second
+// changes.
+class TimestampFormatter {
+ public:
+  explicit TimestampFormatter(std::string format);
+  // The result is valid until the next call
+  const std::string& format(std::chrono::system_clock::time_point time);
+
+ private:
+  std::string format_;
+  std::time_t formatted_time_{};
+  bool has_formatted_{};
+  std::string formatted_;
+};
 
 }  // namespace darc2json
 #endif  // UTIL_H_